@@ -0,0 +1,80 @@
+/// \file
+/// \brief Bump-pointer arena
+
+#pragma once
+
+#include "utils.hpp"
+#include <cstring>
+#include <memory>
+#include <string_view>
+#include <vector>
+
+namespace detail {
+
+/// Bump-pointer allocator of chars. Memory is allocated in pages and released all at once, there
+/// is no per-allocation overhead and no way to free a single allocation.
+class arena_t {
+public:
+  static constexpr size_t page_size = 64 * 1024;
+
+  arena_t() = default;
+  arena_t(const arena_t &) = delete;
+  arena_t(arena_t &&other) noexcept { swap(other); }
+  arena_t &operator=(const arena_t &) = delete;
+  arena_t &operator=(arena_t &&other) noexcept { swap(other); return *this; }
+
+  void swap(arena_t &other) noexcept {
+    m_pages.swap(other.m_pages);
+    std::swap(m_pos, other.m_pos);
+    std::swap(m_end, other.m_end);
+    std::swap(m_allocated, other.m_allocated);
+  }
+
+  char *allocate(size_t size) {
+    if (UNLIKELY(size > size_t(m_end - m_pos))) return allocate_page(size);
+    char *res = m_pos;
+    m_pos += size;
+    return res;
+  }
+
+  const char *copy(std::string_view sv) {
+    char *res = allocate(std::size(sv));
+    memcpy(res, std::data(sv), std::size(sv));
+    return res;
+  }
+
+  /// Releases all the pages.
+  void clear() noexcept {
+    m_pages.clear();
+    m_pos = m_end = nullptr;
+    m_allocated = 0;
+  }
+
+  size_t allocated_bytes() const noexcept { return m_allocated; }  // pages, not allocations!
+
+private:
+  std::vector<std::unique_ptr<char[]>> m_pages;
+  char *m_pos = nullptr;  // free space of the current page
+  char *m_end = nullptr;
+  size_t m_allocated = 0;
+
+  char *allocate_page(size_t size) {
+    // Large allocations get pages of their own, so the current page is not wasted
+    bool dedicated = size > page_size / 4;
+    size_t alloc_size = dedicated ? size : page_size;
+    m_pages.emplace_back(new char[alloc_size]);
+    m_allocated += alloc_size;
+    char *page = m_pages.back().get();
+    if (!dedicated) {
+      m_pos = page + size;
+      m_end = page + alloc_size;
+    }
+    return page;
+  }
+};
+
+} // detail::
+
+
+/* ==TRASH==
+*/
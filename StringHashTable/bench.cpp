@@ -0,0 +1,473 @@
+/// \file
+/// \brief Benchmarks: string_hash_table_t vs std::unordered_map
+///
+/// Usage: StringHashTableBench [-n max_size] [-r repeats] [-f filter]
+/// Tables of 2^10 (L1-sized), 2^14, 2^18... elements (up to max_size) are benchmarked for every key length
+/// mix and key frequency distribution. Results are printed as JSON lines, one per measurement:
+/// {"table": ..., "op": ..., "mix": ..., "dist": ..., "size": ..., "threads": ..., "ns_per_op": ...}
+/// ns_per_op is the best of repeats. Random data is seeded, so runs are reproducible.
+
+#include "concurrent_string_hash_table.hpp"
+#include "frozen_string_hash_table.hpp"
+#include "string_dictionary.hpp"
+#include "string_hash_set.hpp"
+#include "string_hash_table.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+// Key length mixes, every size class of string_hash_table_t is covered
+struct key_mix_t {
+  const char *name;
+  size_t min_size;
+  size_t max_size;
+};
+
+static const key_mix_t key_mixes[] = {
+  {"len1-8", 1, 8},        // m1
+  {"len9-16", 9, 16},      // m2
+  {"len17-24", 17, 24},    // m3
+  {"len25-64", 25, 64},    // ms
+  {"len80-200", 80, 200},  // ms, long keys
+  {"len0-100", 0, 100},    // all of m0, m1, m2, m3, ms
+};
+
+enum dist_t { dist_uniform, dist_zipf };
+static const char *dist_names[] = {"uniform", "zipf"};
+
+/// Benchmark data: distinct keys to insert, keys to miss, lookup order.
+struct data_t {
+  std::vector<std::string> keys;
+  std::vector<std::string> miss_keys;
+  std::vector<std::string_view> hits;    // lookup sequence over keys
+  std::vector<std::string_view> misses;  // lookup sequence over miss_keys
+};
+
+// Distinct keys, miss keys are distinct from them (the first char differs by case)
+static void make_keys(const key_mix_t &mix, size_t count, std::mt19937_64 &rnd,
+                      std::vector<std::string> &keys, std::vector<std::string> &miss_keys) {
+  std::uniform_int_distribution<size_t> size_dist(mix.min_size, mix.max_size);
+  std::unordered_map<std::string, char> seen;
+  seen.reserve(count * 2);
+  bool has_empty = false;
+  while (std::size(keys) < count) {
+    size_t size = size_dist(rnd);
+    if (!size) {
+      // Only one empty key exists, it's a hit
+      if (!has_empty) keys.emplace_back();
+      has_empty = true;
+      continue;
+    }
+    std::string key(size, ' ');
+    for (char &c : key) c = char('a' + rnd() % 26);
+    if (!seen.try_emplace(key, 0).second) continue;
+    std::string miss_key = key;
+    miss_key[0] = char(miss_key[0] - 'a' + 'A');
+    keys.push_back(std::move(key));
+    miss_keys.push_back(std::move(miss_key));
+  }
+}
+
+// Indices of count draws over [0, n): uniform ones are a permutation, Zipf ones (s = 1) are
+// sampled from CDF.
+static std::vector<size_t> make_order(dist_t dist, size_t n, size_t count, std::mt19937_64 &rnd) {
+  std::vector<size_t> res(count);
+  if (dist == dist_uniform) {
+    for (size_t i = 0; i < count; ++i) res[i] = i % n;
+    std::shuffle(std::begin(res), std::end(res), rnd);
+  } else {
+    std::vector<double> cdf(n);
+    double sum = 0;
+    for (size_t i = 0; i < n; ++i) cdf[i] = sum += 1.0 / double(i + 1);
+    std::uniform_real_distribution<double> u(0, sum);
+    for (size_t &index : res) {
+      index = std::lower_bound(std::begin(cdf), std::end(cdf), u(rnd)) - std::begin(cdf);
+      index = std::min(index, n - 1);
+    }
+  }
+  return res;
+}
+
+static data_t make_data(const key_mix_t &mix, dist_t dist, size_t size) {
+  std::mt19937_64 rnd(size * 31 + (&mix - key_mixes) * 7 + dist);
+  data_t res;
+  make_keys(mix, size, rnd, res.keys, res.miss_keys);
+  for (size_t index : make_order(dist, std::size(res.keys), size, rnd)) {
+    res.hits.push_back(res.keys[index]);
+  }
+  if (!res.miss_keys.empty()) {
+    for (size_t index : make_order(dist, std::size(res.miss_keys), size, rnd)) {
+      res.misses.push_back(res.miss_keys[index]);
+    }
+  }
+  return res;
+}
+
+// Tables under test share the interface: insert(), find(), erase(), sum().
+
+template <typename Options>
+struct sht_t {
+  string_hash_table_t<uint64_t, Options> table;
+  void insert(std::string_view key) { ++*table.try_emplace(key, 0).first; }
+  bool find(std::string_view key) { return table.find(key); }
+  bool erase(std::string_view key) { return table.erase(key); }
+  uint64_t sum() {
+    uint64_t res = 0;
+    table.for_each([&res](string_hash_key_t &&, uint64_t value) { res += value; });
+    return res;
+  }
+};
+
+// Distinct keys: sum() is the key count rather than the insertion count
+struct shs_t {
+  string_hash_set_t<> table;
+  void insert(std::string_view key) { table.insert(key); }
+  bool find(std::string_view key) { return table.contains(key); }
+  bool erase(std::string_view key) { return table.erase(key); }
+  uint64_t sum() {
+    uint64_t res = 0;
+    table.for_each([&res](string_hash_key_t &&) { ++res; });
+    return res;
+  }
+};
+
+template <typename Key>
+struct umap_t {
+  std::unordered_map<Key, uint64_t> table;
+  void insert(std::string_view key) { ++table.try_emplace(Key(key), 0).first->second; }
+  bool find(std::string_view key) { return table.find(Key(key)) != table.end(); }
+  bool erase(std::string_view key) { return table.erase(Key(key)); }
+  uint64_t sum() {
+    uint64_t res = 0;
+    for (const auto &[key, value] : table) res += value;
+    return res;
+  }
+};
+
+struct options_t {
+  size_t max_size = 1 << 22;  // beyond LLC
+  int repeats = 3;
+  std::string filter;  // substring of "table/op/mix/dist"
+};
+
+static uint64_t check_sum = 0;  // keeps results alive
+
+template <typename F>
+static double measure(int repeats, size_t op_count, F &&run) {
+  double best = HUGE_VAL;
+  for (int i = 0; i < repeats; ++i) {
+    auto start = std::chrono::steady_clock::now();
+    check_sum += run();
+    std::chrono::duration<double, std::nano> time = std::chrono::steady_clock::now() - start;
+    best = std::min(best, time.count() / double(op_count));
+  }
+  return best;
+}
+
+static void report(const options_t &options, const char *table, const char *op,
+                   const key_mix_t &mix, dist_t dist, size_t size, double ns_per_op,
+                   unsigned threads = 1) {
+  std::cout << format("{\"table\": \"%s\", \"op\": \"%s\", \"mix\": \"%s\", \"dist\": \"%s\", "
+                      "\"size\": %zu, \"threads\": %u, \"repeats\": %d, \"ns_per_op\": %.2f}",
+                      table, op, mix.name, dist_names[dist], size, threads, options.repeats,
+                      ns_per_op)
+            << std::endl;
+}
+
+template <typename Table>
+static void bench_table(const options_t &options, const char *name, const data_t &data,
+                        const key_mix_t &mix, dist_t dist, size_t size) {
+  auto enabled = [&](const char *op) {
+    return options.filter.empty() || format("%s/%s/%s/%s", name, op, mix.name,
+      dist_names[dist]).find(options.filter) != std::string::npos;
+  };
+  auto filled = [&data]() {
+    auto table = std::make_unique<Table>();
+    for (std::string_view key : data.hits) table->insert(key);
+    return table;
+  };
+
+  if (enabled("insert")) {
+    report(options, name, "insert", mix, dist, size,
+           measure(options.repeats, std::size(data.hits), [&]() {
+             Table table;
+             for (std::string_view key : data.hits) table.insert(key);
+             return table.sum();
+           }));
+  }
+  if (enabled("find_hit")) {
+    auto table = filled();
+    report(options, name, "find_hit", mix, dist, size,
+           measure(options.repeats, std::size(data.hits), [&]() {
+             uint64_t found = 0;
+             for (std::string_view key : data.hits) found += table->find(key);
+             return found;
+           }));
+  }
+  if (enabled("find_miss") && !data.misses.empty()) {
+    auto table = filled();
+    report(options, name, "find_miss", mix, dist, size,
+           measure(options.repeats, std::size(data.misses), [&]() {
+             uint64_t found = 0;
+             for (std::string_view key : data.misses) found += table->find(key);
+             return found;
+           }));
+  }
+  if (enabled("erase")) {
+    // Erasure needs a filled table: filling and erasing is measured, then filling is subtracted
+    double fill = measure(options.repeats, std::size(data.hits), [&]() {
+      return filled()->sum();
+    });
+    double fill_erase = measure(options.repeats, std::size(data.hits), [&]() {
+      auto table = filled();
+      uint64_t erased = 0;
+      for (std::string_view key : data.hits) erased += table->erase(key);
+      return erased;
+    });
+    report(options, name, "erase", mix, dist, size, std::max(fill_erase - fill, 0.0));
+  }
+  if (enabled("for_each")) {
+    auto table = filled();
+    report(options, name, "for_each", mix, dist, size,
+           measure(options.repeats, std::size(data.keys), [&]() { return table->sum(); }));
+  }
+}
+
+// Batched lookups of string_hash_table_t
+static void bench_batch(const options_t &options, const data_t &data, const key_mix_t &mix,
+                        dist_t dist, size_t size) {
+  const char *name = "string_hash_table_t(batch)";
+  auto enabled = [&](const char *op) {
+    return options.filter.empty() || format("%s/%s/%s/%s", name, op, mix.name,
+      dist_names[dist]).find(options.filter) != std::string::npos;
+  };
+  std::vector<uint64_t *> out(std::max(std::size(data.hits), std::size(data.misses)));
+  string_hash_table_t<uint64_t> table;
+  table.try_emplace_batch(std::data(data.hits), std::size(data.hits), std::data(out));
+
+  if (enabled("insert")) {
+    report(options, name, "insert", mix, dist, size,
+           measure(options.repeats, std::size(data.hits), [&]() {
+             string_hash_table_t<uint64_t> table;
+             table.try_emplace_batch(std::data(data.hits), std::size(data.hits), std::data(out));
+             return table.size();
+           }));
+  }
+  if (enabled("accumulate")) {
+    std::vector<uint64_t> ones(std::size(data.hits), 1);
+    report(options, name, "accumulate", mix, dist, size,
+           measure(options.repeats, std::size(data.hits), [&]() {
+             string_hash_table_t<uint64_t> table;
+             table.accumulate(std::data(data.hits), std::data(ones), std::size(data.hits),
+                              [](uint64_t &sum, uint64_t value) { sum += value; });
+             return table.size();
+           }));
+  }
+  if (enabled("accumulate_column")) {
+    std::vector<uint64_t> ones(std::size(data.hits), 1);
+    std::vector<size_t> offsets{0};
+    std::string chars;
+    for (std::string_view key : data.hits) {
+      chars += key;
+      offsets.push_back(std::size(chars));
+    }
+    chars.append(8, '\0');  // padding
+    report(options, name, "accumulate_column", mix, dist, size,
+           measure(options.repeats, std::size(data.hits), [&]() {
+             string_hash_table_t<uint64_t> table;
+             table.accumulate_column(std::data(offsets), std::data(chars), std::size(data.hits),
+                                     std::data(ones),
+                                     [](uint64_t &sum, uint64_t value) { sum += value; });
+             return table.size();
+           }));
+  }
+  if (enabled("find_hit")) {
+    report(options, name, "find_hit", mix, dist, size,
+           measure(options.repeats, std::size(data.hits), [&]() {
+             table.find_batch(std::data(data.hits), std::size(data.hits), std::data(out));
+             return uint64_t(out[0] != nullptr);
+           }));
+  }
+  if (enabled("find_miss") && !data.misses.empty()) {
+    report(options, name, "find_miss", mix, dist, size,
+           measure(options.repeats, std::size(data.misses), [&]() {
+             table.find_batch(std::data(data.misses), std::size(data.misses), std::data(out));
+             return uint64_t(out[0] != nullptr);
+           }));
+  }
+}
+
+// Insert latency: every insertion is timed, the worst and 99th percentile ones are reported (as
+// ns_per_op). Rehashing all at once shows up in the worst, incremental rehashing spreads it.
+template <typename Options>
+static void bench_insert_latency(const options_t &options, const char *name, const data_t &data,
+                                 const key_mix_t &mix, dist_t dist, size_t size) {
+  if (!options.filter.empty() && format("%s/insert_latency/%s/%s", name, mix.name,
+      dist_names[dist]).find(options.filter) == std::string::npos) {
+    return;
+  }
+  std::vector<double> latencies(std::size(data.keys));
+  double worst = HUGE_VAL;
+  double p99 = HUGE_VAL;
+  for (int r = 0; r < options.repeats; ++r) {
+    string_hash_table_t<uint64_t, Options> table;
+    for (size_t i = 0; i < std::size(data.keys); ++i) {
+      auto start = std::chrono::steady_clock::now();
+      table.try_emplace(data.keys[i], i);
+      std::chrono::duration<double, std::nano> time = std::chrono::steady_clock::now() - start;
+      latencies[i] = time.count();
+    }
+    check_sum += table.size();
+    // The best of the repeats, as measure() does
+    auto nth = std::begin(latencies) + std::size(latencies) * 99 / 100;
+    std::nth_element(std::begin(latencies), nth, std::end(latencies));
+    p99 = std::min(p99, *nth);
+    worst = std::min(worst, *std::max_element(nth, std::end(latencies)));
+  }
+  report(options, name, "insert_p99", mix, dist, size, p99);
+  report(options, name, "insert_worst", mix, dist, size, worst);
+}
+
+// Lookups of a table frozen from the keys
+static void bench_frozen(const options_t &options, const data_t &data, const key_mix_t &mix,
+                         dist_t dist, size_t size) {
+  const char *name = "frozen_string_hash_table_t";
+  auto enabled = [&](const char *op) {
+    return options.filter.empty() || format("%s/%s/%s/%s", name, op, mix.name,
+      dist_names[dist]).find(options.filter) != std::string::npos;
+  };
+  if (!enabled("find_hit") && !enabled("find_miss")) return;
+  std::vector<std::string_view> keys(std::begin(data.keys), std::end(data.keys));
+  std::vector<uint64_t> values(std::size(keys), 1);
+  frozen_string_hash_table_t<uint64_t> table(std::data(keys), std::data(values),
+                                             std::size(keys));
+
+  if (enabled("find_hit")) {
+    report(options, name, "find_hit", mix, dist, size,
+           measure(options.repeats, std::size(data.hits), [&]() {
+             uint64_t found = 0;
+             for (std::string_view key : data.hits) found += table.contains(key);
+             return found;
+           }));
+  }
+  if (enabled("find_miss") && !data.misses.empty()) {
+    report(options, name, "find_miss", mix, dist, size,
+           measure(options.repeats, std::size(data.misses), [&]() {
+             uint64_t found = 0;
+             for (std::string_view key : data.misses) found += table.contains(key);
+             return found;
+           }));
+  }
+}
+
+// Dictionary encoding of the keys as a column
+static void bench_dictionary(const options_t &options, const data_t &data, const key_mix_t &mix,
+                             dist_t dist, size_t size) {
+  const char *name = "string_dictionary_t";
+  if (!options.filter.empty() && format("%s/encode/%s/%s", name, mix.name,
+      dist_names[dist]).find(options.filter) == std::string::npos) {
+    return;
+  }
+  std::vector<uint32_t> ids(std::size(data.hits));
+  report(options, name, "encode", mix, dist, size,
+         measure(options.repeats, std::size(data.hits), [&]() {
+           string_dictionary_t<> dictionary;
+           dictionary.encode(std::data(data.hits), std::size(data.hits), std::data(ids));
+           return dictionary.size();
+         }));
+}
+
+// Concurrent counting: threads insert interleaved slices of the keys. ns_per_op is wall time per
+// key, so it drops with the thread count as far as the table scales.
+static void bench_concurrent(const options_t &options, const data_t &data, const key_mix_t &mix,
+                             dist_t dist, size_t size) {
+  const char *name = "concurrent_string_hash_table_t";
+  if (!options.filter.empty() && format("%s/insert/%s/%s", name, mix.name,
+      dist_names[dist]).find(options.filter) == std::string::npos) {
+    return;
+  }
+  unsigned max_threads = std::max(std::thread::hardware_concurrency(), 1u);
+  for (unsigned thread_count = 1;; thread_count = std::min(thread_count * 2, max_threads)) {
+    report(options, name, "insert", mix, dist, size,
+           measure(options.repeats, std::size(data.hits), [&]() {
+             concurrent_string_hash_table_t<uint64_t> table;
+             std::vector<std::thread> threads;
+             for (unsigned t = 0; t < thread_count; ++t) {
+               threads.emplace_back([&table, &data, t, thread_count]() {
+                 for (size_t i = t; i < std::size(data.hits); i += thread_count) {
+                   table.try_emplace_visit(data.hits[i], [](uint64_t &value) { ++value; }, 0);
+                 }
+               });
+             }
+             for (std::thread &thread : threads) thread.join();
+             return table.size();
+           }), thread_count);
+    if (thread_count == max_threads) break;
+  }
+}
+
+int main(int argc, char *argv[]) {
+  try {
+    options_t options;
+    for (int i = 1; i + 1 < argc; i += 2) {
+      std::string_view arg = argv[i];
+      if (arg == "-n") options.max_size = std::strtoull(argv[i + 1], nullptr, 10);
+      else if (arg == "-r") options.repeats = std::max(1, std::atoi(argv[i + 1]));
+      else if (arg == "-f") options.filter = argv[i + 1];
+      else error("Unknown option: %s", argv[i]);
+    }
+
+    std::cerr << "hash kernel: " << detail::hash_kernel().name << ", group width: "
+              << detail::group_t::width << std::endl;
+    for (size_t size = 1 << 10; size <= options.max_size; size <<= 4) {
+      for (const key_mix_t &mix : key_mixes) {
+        for (dist_t dist : {dist_uniform, dist_zipf}) {
+          data_t data = make_data(mix, dist, size);
+          bench_table<sht_t<string_hash_table_options>>(options, "string_hash_table_t", data,
+                                                        mix, dist, size);
+          bench_table<sht_t<arena_string_hash_table_options>>(options, "arena_string_hash_table_t",
+                                                              data, mix, dist, size);
+          bench_table<sht_t<dense_string_hash_table_options>>(options, "dense_string_hash_table_t",
+                                                              data, mix, dist, size);
+          bench_table<sht_t<filtered_string_hash_table_options>>(
+            options, "filtered_string_hash_table_t", data, mix, dist, size);
+          bench_table<shs_t>(options, "string_hash_set_t", data, mix, dist, size);
+          bench_insert_latency<string_hash_table_options>(options, "string_hash_table_t", data,
+                                                          mix, dist, size);
+          bench_insert_latency<incremental_string_hash_table_options>(
+            options, "incremental_string_hash_table_t", data, mix, dist, size);
+          bench_batch(options, data, mix, dist, size);
+          bench_dictionary(options, data, mix, dist, size);
+          bench_frozen(options, data, mix, dist, size);
+          bench_concurrent(options, data, mix, dist, size);
+          bench_table<umap_t<std::string>>(options, "unordered_map<string>", data, mix, dist,
+                                           size);
+          bench_table<umap_t<std::string_view>>(options, "unordered_map<string_view>", data,
+                                                mix, dist, size);
+        }
+      }
+    }
+    std::cerr << "check sum: " << check_sum << std::endl;
+    return 0;
+  }
+  catch (const std::exception &e) {
+    std::cerr << e.what() << std::endl;
+  }
+  catch (...) {
+    std::cerr << "Unknown application error" << std::endl;
+  }
+
+  return -1;
+}
+
+
+/* ==TRASH==
+*/
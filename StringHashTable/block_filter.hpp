@@ -0,0 +1,264 @@
+/// \file
+/// \brief Split block Bloom filter of hashes and a map adaptor filtering lookups by it
+
+#pragma once
+
+#include "flat_map.hpp"
+#include "utils.hpp"
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include <immintrin.h>
+
+namespace detail {
+
+/// Occupancy and efficiency of a block_filter_t.
+struct block_filter_stats_t {
+  size_t memory_bytes = 0;
+  double estimated_fpr = 0;  // false positive rate by the set bits
+  // Lookups, insertions and erasures, if counted (see filtered_map_t)
+  uint64_t rejects = 0;          // definite misses, the map was not probed
+  uint64_t false_positives = 0;  // passed the filter, but not found
+};
+
+/// Split block Bloom filter of 32-bit hashes: a hash selects a 256-bit block and sets one bit in
+/// each of its eight 32-bit words. So a check loads one block (half a cache line) and tests
+/// eight bits at once with AVX2 if CPU supports it (checked at run time, as the hash kernels
+/// are), or with a branchless scalar loop. A hash that was added is always
+/// reported, others are with the false positive rate (under 1% at 16 bits per hash).
+/// Hashes cannot be removed, reset() rebuilds the filter.
+class block_filter_t {
+public:
+  static constexpr size_t bits_per_hash = 16;
+
+  bool empty() const noexcept { return m_blocks.empty(); }
+  /// Hashes the filter is sized for.
+  size_t capacity() const noexcept { return m_capacity; }
+  size_t memory_bytes() const noexcept { return m_blocks.capacity() * sizeof(block_t); }
+
+  /// Clears the filter and sizes it for hash_count hashes.
+  void reset(size_t hash_count) {
+    size_t block_count = 1;
+    while (block_count * block_bits < hash_count * bits_per_hash) block_count <<= 1;
+    m_blocks.assign(block_count, block_t());
+    m_capacity = block_count * block_bits / bits_per_hash;
+  }
+  void clear() noexcept { std::fill(std::begin(m_blocks), std::end(m_blocks), block_t()); }
+
+  void add(size_t hash) {
+    block_t &block = block_of(hash);
+    if (m_avx2) {
+      add_avx2(block, hash);
+      return;
+    }
+    for (size_t i = 0; i < block_words; ++i) block.words[i] |= bit_of(hash, i);
+  }
+  /// False if the hash was never added. An empty (never sized) filter has no hashes.
+  bool may_contain(size_t hash) const {
+    if (UNLIKELY(m_blocks.empty())) return false;
+    const block_t &block = block_of(hash);
+    if (m_avx2) return may_contain_avx2(block, hash);
+    uint32_t missing = 0;
+    for (size_t i = 0; i < block_words; ++i) missing |= ~block.words[i] & bit_of(hash, i);
+    return !missing;
+  }
+
+  void prefetch(size_t hash) const {
+    if (!m_blocks.empty()) _mm_prefetch(reinterpret_cast<const char *>(&block_of(hash)),
+                                        _MM_HINT_T0);
+  }
+
+  /// Note: it's O(size).
+  double estimated_fpr() const;
+
+private:
+  static constexpr size_t block_words = 8;
+  static constexpr size_t block_bits = block_words * 32;
+
+  struct alignas(32) block_t {
+    uint32_t words[block_words] = {};
+  };
+
+  // Odd multipliers, one per word, pick the bits from the hash
+  static constexpr uint32_t salts[block_words] = {0x47b6137b, 0x44974d91, 0x8824ad5b, 0xa2b7289d,
+                                                  0x705495c7, 0x2df1424b, 0x9efc4947, 0x5c6bfb31};
+
+  std::vector<block_t> m_blocks;  // power of 2 of them
+  size_t m_capacity = 0;
+  bool m_avx2 = avx2_supported();  // a member, not to check a static's guard per lookup
+
+  // Blocks are selected by the high bits of the spread hash, see hash_h1()
+  block_t &block_of(size_t hash) {
+    return m_blocks[hash_h1(hash) & (std::size(m_blocks) - 1)];
+  }
+  const block_t &block_of(size_t hash) const {
+    return m_blocks[hash_h1(hash) & (std::size(m_blocks) - 1)];
+  }
+  static uint32_t bit_of(size_t hash, size_t word) {
+    return uint32_t(1) << ((uint32_t(hash) * salts[word]) >> 27);
+  }
+
+  static bool avx2_supported() {
+    static const bool res = []() {
+      __builtin_cpu_init();
+      return bool(__builtin_cpu_supports("avx2"));
+    }();
+    return res;
+  }
+  // AVX2 kernels, the same bits as bit_of() of all the words at once
+  __attribute__((target("avx2")))
+  static __m256i mask_of(size_t hash) {
+    const __m256i salt = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(salts));
+    __m256i shifts = _mm256_srli_epi32(_mm256_mullo_epi32(_mm256_set1_epi32(int(hash)), salt),
+                                       27);
+    return _mm256_sllv_epi32(_mm256_set1_epi32(1), shifts);
+  }
+  __attribute__((target("avx2")))
+  static void add_avx2(block_t &block, size_t hash) {
+    __m256i *words = reinterpret_cast<__m256i *>(block.words);
+    _mm256_store_si256(words, _mm256_or_si256(_mm256_load_si256(words), mask_of(hash)));
+  }
+  __attribute__((target("avx2")))
+  static bool may_contain_avx2(const block_t &block, size_t hash) {
+    return _mm256_testc_si256(_mm256_load_si256(reinterpret_cast<const __m256i *>(block.words)),
+                              mask_of(hash));
+  }
+};
+
+inline double block_filter_t::estimated_fpr() const {
+  // A miss passes if all its eight bits are set: the product of the words' fill ratios
+  double res = 0;
+  for (const block_t &block : m_blocks) {
+    double p = 1;
+    for (uint32_t word : block.words) p *= double(__builtin_popcount(word)) / 32;
+    res += p;
+  }
+  return m_blocks.empty() ? 0 : res / double(std::size(m_blocks));
+}
+
+/// Map (flat_map_t or dense_map_t) with a block_filter_t of its keys' hashes: lookups and
+/// erasures of keys the filter rejects return without probing, insertions of them probe for a
+/// free slot only, without comparing keys. It pays off where a probe is expensive (e.g. long
+/// keys having chars out of the slots) and most lookups miss. The filter grows with the map,
+/// erased keys stay in it till rebuild_filter(). If Counters, rejects and false positives of
+/// lookups are counted (not thread-safe, as string_hash_table_counters).
+template <typename Map, typename Hash, bool Counters>
+class filtered_map_t : public Map {
+public:
+  using typename Map::value_type;
+  using Map::npos;
+
+  void clear() noexcept {
+    Map::clear();
+    m_filter.clear();
+  }
+  void swap(filtered_map_t &other) noexcept {
+    Map::swap(other);
+    std::swap(m_filter, other.m_filter);
+    std::swap(m_rejects, other.m_rejects);
+    std::swap(m_false_positives, other.m_false_positives);
+  }
+  void reserve(size_t elem_count) {
+    Map::reserve(elem_count);
+    if (elem_count > m_filter.capacity()) rebuild(elem_count);
+  }
+
+  void prefetch(size_t hash) const {
+    m_filter.prefetch(hash);
+    Map::prefetch(hash);
+  }
+
+  template <typename Eq>
+  size_t find_index(size_t hash, Eq &&eq) const {
+    if (!m_filter.may_contain(hash)) {
+      if constexpr (Counters) ++m_rejects;
+      return npos;
+    }
+    size_t res = Map::find_index(hash, std::forward<Eq>(eq));
+    if constexpr (Counters) m_false_positives += res == npos;
+    return res;
+  }
+  template <typename L>
+  value_type *find(const L &key) {
+    size_t index = find_index(Hash()(key), [&key](const auto &k) { return k == key; });
+    return index != npos ? &this->slot(index) : nullptr;
+  }
+
+  template <typename Eq>
+  std::pair<size_t, bool> find_or_prepare_insert(size_t hash, Eq &&eq) {
+    // The key is absent: keys with matching h2 are not compared
+    if (!m_filter.may_contain(hash)) {
+      if constexpr (Counters) ++m_rejects;
+      return Map::find_or_prepare_insert(hash, [](const auto &) { return false; });
+    }
+    auto res = Map::find_or_prepare_insert(hash, std::forward<Eq>(eq));
+    if constexpr (Counters) m_false_positives += !res.second;
+    return res;
+  }
+
+  // Map::try_emplace() would bypass the filter
+  template <typename... Args>
+  std::pair<value_type *, bool> try_emplace(const typename Map::key_type &key, Args &&... args) {
+    size_t hash = Hash()(key);
+    auto [index, found] = find_or_prepare_insert(hash, [&key](const auto &k) { return k == key; });
+    if (found) return {&this->slot(index), false};
+    value_type &res = emplace_at(index, hash, std::piecewise_construct, std::forward_as_tuple(key),
+                                 std::forward_as_tuple(std::forward<Args>(args)...));
+    return {&res, true};
+  }
+
+  template <typename L>
+  bool erase(const L &key) {
+    size_t index = find_index(Hash()(key), [&key](const auto &k) { return k == key; });
+    if (index == npos) return false;
+    this->erase_at(index);
+    return true;
+  }
+
+  template <typename... Args>
+  value_type &emplace_at(size_t index, size_t hash, Args &&... args) {
+    value_type &res = Map::emplace_at(index, hash, std::forward<Args>(args)...);
+    // Growth rebuilds the filter of all the keys, the emplaced one included
+    if (UNLIKELY(this->size() > m_filter.capacity())) rebuild(this->size() * 2);
+    else m_filter.add(hash);
+    return res;
+  }
+
+  /// Rebuilds the filter of the current keys (sized as on growth), e.g. after many erasures.
+  void rebuild_filter() { rebuild(this->size() * 2); }
+
+  /// Note: it's O(filter size).
+  block_filter_stats_t filter_stats() const {
+    block_filter_stats_t res;
+    res.memory_bytes = m_filter.memory_bytes();
+    res.estimated_fpr = m_filter.estimated_fpr();
+    if constexpr (Counters) {
+      res.rejects = m_rejects;
+      res.false_positives = m_false_positives;
+    }
+    return res;
+  }
+  size_t memory_bytes() const noexcept { return Map::memory_bytes() + m_filter.memory_bytes(); }
+
+private:
+  struct no_counter {};
+  using counter_t = std::conditional_t<Counters, uint64_t, no_counter>;
+
+  block_filter_t m_filter;
+  mutable counter_t m_rejects = {};
+  mutable counter_t m_false_positives = {};
+
+  void rebuild(size_t hash_count) {
+    m_filter.reset(hash_count);
+    for (const value_type &slot : *this) m_filter.add(Hash()(slot.first));
+  }
+};
+
+} // detail::
+
+
+/* ==TRASH==
+*/
@@ -0,0 +1,350 @@
+/// \file
+/// \brief Sharded string hash table for concurrent use
+
+#pragma once
+
+#include "arena.hpp"
+#include "string_hash_table.hpp"
+#include <algorithm>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string_view>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+/// Thread-safe hash table with string keys. Keys are spread over shards by the high bits of their
+/// hashes, every shard is a string_hash_table_t with a reader-writer lock of its own. So threads
+/// contend only when they hit the same shard.
+/// Mapped values are never exposed out of locks: they are passed to callbacks called under the
+/// shard lock. Callbacks must not call the table back.
+/// Note: with Options::counters lookups lock shards exclusively (they update the counters), so
+/// readers of a shard do not run in parallel then. Enable counters to profile, not in production.
+template <typename T, typename Options = string_hash_table_options>
+class concurrent_string_hash_table_t {
+public:
+  using key_type = string_hash_key_t;
+  using mapped_type = T;
+  using table_type = string_hash_table_t<T, Options>;
+
+  /// shard_count is rounded up to a power of 2, by default it's 4 shards per hardware thread.
+  explicit concurrent_string_hash_table_t(size_t shard_count = default_shard_count());
+  concurrent_string_hash_table_t(const concurrent_string_hash_table_t &) = delete;
+  concurrent_string_hash_table_t &operator=(const concurrent_string_hash_table_t &) = delete;
+
+  size_t shard_count() const noexcept { return size_t(1) << m_shard_bits; }
+
+  // Note: the whole table is not locked at once, so size() and empty() are not atomic snapshots
+  // under concurrent modification.
+  bool empty() const;
+  size_t size() const;
+  void clear();
+  void reserve(size_t elem_count);  // elements, spread evenly over shards
+
+  /// Calls f(const mapped_type &) under shared lock, if the key is contained.
+  template <typename F>
+  bool find(std::string_view key, F &&f) const;
+  bool contains(std::string_view key) const { return find(key, [](const mapped_type &) {}); }
+  /// Calls f(mapped_type &) under exclusive lock, if the key is contained.
+  template <typename F>
+  bool visit(std::string_view key, F &&f);
+  /// Returns true if inserted.
+  template <typename... Args>
+  bool try_emplace(std::string_view key, Args &&... args) {
+    return try_emplace_visit(key, [](mapped_type &) {}, std::forward<Args>(args)...);
+  }
+  /// try_emplace(), then calls f(mapped_type &) for the contained or inserted value under the same
+  /// exclusive lock (e.g. to count keys).
+  template <typename F, typename... Args>
+  bool try_emplace_visit(std::string_view key, F &&f, Args &&... args);
+  bool erase(std::string_view key);
+
+  /// Calls f(string_hash_key_t &&, const mapped_type &) for every element, a shard at a time
+  /// under its shared lock. It's safe while the table is modified: every shard is seen in a
+  /// consistent state, but shards are seen at different moments.
+  template <typename F>
+  void for_each(F &&f) const;
+
+  // Parallel bulk operations, thread_count = 0 means hardware concurrency. Other operations may
+  // run meanwhile.
+
+  /// Group-by build: for every keys[i], try_emplace(keys[i]) and f(mapped_type &, i). Keys are
+  /// radix-partitioned by shard into per-thread buffers, then every thread builds whole shards,
+  /// so the threads do not contend. f is called for rows of the same key in order of i.
+  template <typename F>
+  void bulk_build(const std::string_view *keys, size_t count, F &&f, unsigned thread_count = 0);
+  /// Folds other (a string_hash_table_t, e.g. a per-thread partial aggregate) into the table:
+  /// absent keys are inserted with copies of other's values, values of present ones are combined
+  /// by combiner(mapped_type &, const mapped_type &). As in bulk_build(), threads partition
+  /// slot ranges of other's submaps by shard, then shards are merged in parallel. Other must not
+  /// be modified meanwhile.
+  template <typename OtherOptions, typename F>
+  void merge(const string_hash_table_t<T, OtherOptions> &other, F &&combiner,
+             unsigned thread_count = 0);
+  /// The same for another concurrent table: shards of other are copied out in parallel, then
+  /// partitioned and merged like the above. Locks of both tables are never held at once, so
+  /// other may be the table itself (every value is combined with its copy).
+  template <typename OtherOptions, typename F>
+  void merge(const concurrent_string_hash_table_t<T, OtherOptions> &other, F &&combiner,
+             unsigned thread_count = 0);
+
+private:
+  template <typename U, typename O> friend class concurrent_string_hash_table_t;
+
+  struct alignas(64) shard_t {  // own cache line for the lock
+    mutable std::shared_mutex mutex;
+    mutable table_type table;  // lookups of the table are not const (counters)
+  };
+  // Note: Options::counters are plain integers, so lookups lock exclusively to maintain them.
+  using read_lock_t = std::conditional_t<Options::counters, std::unique_lock<std::shared_mutex>,
+                                         std::shared_lock<std::shared_mutex>>;
+  using write_lock_t = std::unique_lock<std::shared_mutex>;
+
+  std::unique_ptr<shard_t[]> m_shards;
+  int m_shard_bits;
+
+  static size_t default_shard_count() {
+    return std::max<size_t>(std::thread::hardware_concurrency(), 1) * 4;
+  }
+  // High bits of h1: a shard's table selects groups by low bits of h1, so they are independent
+  // unless a shard gets 2^(32 - shard bits) groups.
+  size_t shard_index(size_t hash) const { return detail::hash_h1(hash) >> (32 - m_shard_bits); }
+  shard_t &shard(size_t hash) const { return m_shards[shard_index(hash)]; }
+  // Calls f(i) for i in [0, count) by thread_count threads, i is taken by thread i % thread_count.
+  template <typename F>
+  static void parallel_for(size_t count, unsigned thread_count, F &&f);
+  // Radix partitioning: feed(part, emit) calls emit(key, hash, row) for every row of the input
+  // part, the rows are buffered by shard. Then every shard is built by a single thread:
+  // f(table, key, hash, row) is called for its rows in order of parts and emission.
+  template <typename Row, typename Feed, typename F>
+  void partitioned(size_t part_count, Feed &&feed, F &&f, unsigned thread_count);
+};
+
+template <typename T, typename Options>
+concurrent_string_hash_table_t<T, Options>::concurrent_string_hash_table_t(size_t shard_count) {
+  m_shard_bits = 0;
+  while ((size_t(1) << m_shard_bits) < shard_count && m_shard_bits < 16) ++m_shard_bits;
+  m_shards.reset(new shard_t[size_t(1) << m_shard_bits]);
+}
+
+template <typename T, typename Options>
+bool concurrent_string_hash_table_t<T, Options>::empty() const {
+  for (size_t i = 0; i < shard_count(); ++i) {
+    read_lock_t lock(m_shards[i].mutex);
+    if (!m_shards[i].table.empty()) return false;
+  }
+  return true;
+}
+
+template <typename T, typename Options>
+size_t concurrent_string_hash_table_t<T, Options>::size() const {
+  size_t res = 0;
+  for (size_t i = 0; i < shard_count(); ++i) {
+    read_lock_t lock(m_shards[i].mutex);
+    res += m_shards[i].table.size();
+  }
+  return res;
+}
+
+template <typename T, typename Options>
+void concurrent_string_hash_table_t<T, Options>::clear() {
+  for (size_t i = 0; i < shard_count(); ++i) {
+    write_lock_t lock(m_shards[i].mutex);
+    m_shards[i].table.clear();
+  }
+}
+
+template <typename T, typename Options>
+void concurrent_string_hash_table_t<T, Options>::reserve(size_t elem_count) {
+  size_t shard_elem_count = (elem_count + shard_count() - 1) / shard_count();
+  for (size_t i = 0; i < shard_count(); ++i) {
+    write_lock_t lock(m_shards[i].mutex);
+    m_shards[i].table.reserve(shard_elem_count);
+  }
+}
+
+template <typename T, typename Options>
+template <typename F>
+bool concurrent_string_hash_table_t<T, Options>::find(std::string_view key, F &&f) const {
+  size_t hash = table_type::hash_of(key);
+  shard_t &s = shard(hash);
+  read_lock_t lock(s.mutex);
+  const mapped_type *value = s.table.find_hashed(key, hash);
+  if (!value) return false;
+  f(*value);
+  return true;
+}
+
+template <typename T, typename Options>
+template <typename F>
+bool concurrent_string_hash_table_t<T, Options>::visit(std::string_view key, F &&f) {
+  size_t hash = table_type::hash_of(key);
+  shard_t &s = shard(hash);
+  write_lock_t lock(s.mutex);
+  mapped_type *value = s.table.find_hashed(key, hash);
+  if (!value) return false;
+  f(*value);
+  return true;
+}
+
+template <typename T, typename Options>
+template <typename F, typename... Args>
+bool concurrent_string_hash_table_t<T, Options>::try_emplace_visit(std::string_view key, F &&f,
+                                                                   Args &&... args) {
+  size_t hash = table_type::hash_of(key);
+  shard_t &s = shard(hash);
+  write_lock_t lock(s.mutex);
+  auto [value, inserted] = s.table.try_emplace_hashed(key, hash, std::forward<Args>(args)...);
+  f(*value);
+  return inserted;
+}
+
+template <typename T, typename Options>
+bool concurrent_string_hash_table_t<T, Options>::erase(std::string_view key) {
+  size_t hash = table_type::hash_of(key);
+  shard_t &s = shard(hash);
+  write_lock_t lock(s.mutex);
+  return s.table.erase_hashed(key, hash);
+}
+
+template <typename T, typename Options>
+template <typename F>
+void concurrent_string_hash_table_t<T, Options>::for_each(F &&f) const {
+  for (size_t i = 0; i < shard_count(); ++i) {
+    std::shared_lock<std::shared_mutex> lock(m_shards[i].mutex);
+    m_shards[i].table.for_each(f);
+  }
+}
+
+
+template <typename T, typename Options>
+template <typename F>
+void concurrent_string_hash_table_t<T, Options>::parallel_for(size_t count, unsigned thread_count,
+                                                              F &&f) {
+  if (!count) return;
+  if (!thread_count) thread_count = std::max(std::thread::hardware_concurrency(), 1u);
+  thread_count = unsigned(std::min<size_t>(thread_count, count));
+  std::vector<std::thread> threads;
+  for (unsigned t = 1; t < thread_count; ++t) {
+    threads.emplace_back([&f, t, thread_count, count]() {
+      for (size_t i = t; i < count; i += thread_count) f(i);
+    });
+  }
+  for (size_t i = 0; i < count; i += thread_count) f(i);
+  for (std::thread &thread : threads) thread.join();
+}
+
+template <typename T, typename Options>
+template <typename Row, typename Feed, typename F>
+void concurrent_string_hash_table_t<T, Options>::partitioned(size_t part_count, Feed &&feed, F &&f,
+                                                             unsigned thread_count) {
+  struct entry_t {
+    std::string_view key;
+    size_t hash;
+    Row row;
+  };
+  // buffers[part][shard]: phase 1 writes parts, phase 2 reads shards
+  std::vector<std::vector<std::vector<entry_t>>> buffers(part_count);
+  parallel_for(part_count, thread_count, [&](size_t part) {
+    auto &part_buffers = buffers[part];
+    part_buffers.resize(shard_count());
+    feed(part, [&](std::string_view key, size_t hash, Row row) {
+      part_buffers[shard_index(hash)].push_back({key, hash, row});
+    });
+  });
+  parallel_for(shard_count(), thread_count, [&](size_t i) {
+    shard_t &s = m_shards[i];
+    write_lock_t lock(s.mutex);
+    size_t count = 0;
+    for (const auto &part_buffers : buffers) count += std::size(part_buffers[i]);
+    s.table.reserve(s.table.size() + count);
+    for (const auto &part_buffers : buffers) {
+      for (const entry_t &entry : part_buffers[i]) f(s.table, entry.key, entry.hash, entry.row);
+    }
+  });
+}
+
+template <typename T, typename Options>
+template <typename F>
+void concurrent_string_hash_table_t<T, Options>::bulk_build(const std::string_view *keys,
+                                                            size_t count, F &&f,
+                                                            unsigned thread_count) {
+  if (!thread_count) thread_count = std::max(std::thread::hardware_concurrency(), 1u);
+  constexpr size_t min_part_size = 4096;
+  size_t part_count = std::clamp<size_t>(count / min_part_size, 1, thread_count);
+  size_t part_size = (count + part_count - 1) / part_count;
+  partitioned<size_t>(
+    part_count,
+    [keys, count, part_size](size_t part, auto &&emit) {
+      for (size_t i = part * part_size, end = std::min(i + part_size, count); i < end; ++i) {
+        emit(keys[i], table_type::hash_of(keys[i]), i);
+      }
+    },
+    [&f](table_type &table, std::string_view key, size_t hash, size_t row) {
+      f(*table.try_emplace_hashed(key, hash).first, row);
+    },
+    thread_count);
+}
+
+template <typename T, typename Options>
+template <typename OtherOptions, typename F>
+void concurrent_string_hash_table_t<T, Options>::merge(
+  const string_hash_table_t<T, OtherOptions> &other, F &&combiner, unsigned thread_count) {
+  if (!thread_count) thread_count = std::max(std::thread::hardware_concurrency(), 1u);
+  constexpr size_t min_part_size = 4096;
+  size_t part_count = std::clamp<size_t>(other.size() / min_part_size, 1, thread_count);
+  partitioned<const mapped_type *>(
+    part_count,
+    [&other, part_count](size_t part, auto &&emit) {
+      other.for_each_hashed(part, part_count, [&emit](std::string_view key, size_t hash,
+                                                      const mapped_type &value) {
+        emit(key, hash, &value);
+      });
+    },
+    [&combiner](table_type &table, std::string_view key, size_t hash, const mapped_type *value) {
+      auto [mine, inserted] = table.try_emplace_hashed(key, hash, *value);
+      if (!inserted) combiner(*mine, *value);
+    },
+    thread_count);
+}
+
+template <typename T, typename Options>
+template <typename OtherOptions, typename F>
+void concurrent_string_hash_table_t<T, Options>::merge(
+  const concurrent_string_hash_table_t<T, OtherOptions> &other, F &&combiner,
+  unsigned thread_count) {
+  // Shards of other are copied out under their shared locks, then released before the shards of
+  // the table are locked: no thread holds locks of both tables, so merges of tables into each
+  // other (or of a table into itself) can't deadlock
+  struct element_t {
+    std::string_view key;  // in the arena of the part
+    size_t hash;
+    mapped_type value;
+  };
+  std::vector<detail::arena_t> arenas(other.shard_count());
+  std::vector<std::vector<element_t>> snapshots(other.shard_count());
+  partitioned<const mapped_type *>(
+    other.shard_count(),
+    [&other, &arenas, &snapshots](size_t part, auto &&emit) {
+      auto &snapshot = snapshots[part];
+      {
+        const auto &other_shard = other.m_shards[part];
+        std::shared_lock<std::shared_mutex> lock(other_shard.mutex);
+        snapshot.reserve(other_shard.table.size());
+        other_shard.table.for_each_hashed([&](std::string_view key, size_t hash,
+                                              const mapped_type &value) {
+          snapshot.push_back({{arenas[part].copy(key), std::size(key)}, hash, value});
+        });
+      }
+      for (const element_t &elem : snapshot) emit(elem.key, elem.hash, &elem.value);
+    },
+    [&combiner](table_type &table, std::string_view key, size_t hash, const mapped_type *value) {
+      auto [mine, inserted] = table.try_emplace_hashed(key, hash, *value);
+      if (!inserted) combiner(*mine, *value);
+    },
+    thread_count);
+}
+
+/* ==TRASH==
+*/
@@ -0,0 +1,292 @@
+/// \file
+/// \brief Hash map with elements in a dense array and a flat index of their numbers
+
+#pragma once
+
+#include "flat_map.hpp"
+#include "utils.hpp"
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <new>
+#include <utility>
+#include <vector>
+
+namespace detail {
+
+/// Hash map with key/value pairs in a dense array, in insertion order unless erased. The index
+/// is a flat open-addressing table (see flat_map_t) of control bytes and 32-bit element numbers.
+/// So iteration is a sequential pass over the elements, and rehashing moves 4-byte numbers
+/// rather than elements. Erasure moves the last element into the hole.
+/// Pointers to elements are invalidated by insertion and erasure. Elements are addressed by
+/// their numbers: find_index() returns one, slot() takes one.
+template <typename K, typename T, typename Hash>
+class dense_map_t {
+public:
+  using key_type = K;
+  using mapped_type = T;
+  using value_type = slot_t<K, T>;
+  using iterator = value_type *;
+  using const_iterator = const value_type *;
+
+  static constexpr size_t npos = size_t(-1);
+
+  dense_map_t() noexcept { reset(); }
+  dense_map_t(const dense_map_t &other) : dense_map_t() {
+    m_values = other.m_values;
+    if (other.m_capacity) rehash(other.m_capacity);
+  }
+  dense_map_t(dense_map_t &&other) noexcept : dense_map_t() { swap(other); }
+  dense_map_t &operator=(dense_map_t other) noexcept { swap(other); return *this; }
+  ~dense_map_t() { deallocate(); }
+
+  void swap(dense_map_t &other) noexcept {
+    std::swap(m_ctrl, other.m_ctrl);
+    std::swap(m_index, other.m_index);
+    std::swap(m_capacity, other.m_capacity);
+    std::swap(m_growth_left, other.m_growth_left);
+    m_values.swap(other.m_values);
+  }
+
+  bool empty() const noexcept { return m_values.empty(); }
+  size_t size() const noexcept { return std::size(m_values); }
+  size_t capacity() const noexcept { return m_capacity; }  // index slots, not elements!
+  /// Elements the capacity holds (tombstones aside) without rehashing.
+  size_t max_load() const noexcept { return capacity_to_growth(m_capacity); }
+
+  void clear() noexcept {
+    m_values.clear();
+    if (!m_capacity) return;
+    memset(m_ctrl, ctrl_empty, m_capacity);
+    m_growth_left = capacity_to_growth(m_capacity);
+  }
+  void reserve(size_t elem_count) {
+    m_values.reserve(elem_count);
+    if (elem_count <= size() + m_growth_left) return;
+    size_t capacity = group_t::width;
+    while (capacity_to_growth(capacity) < elem_count) capacity <<= 1;
+    rehash(std::max(capacity, m_capacity));
+  }
+
+  iterator begin() { return std::data(m_values); }
+  iterator end() { return std::data(m_values) + std::size(m_values); }
+  const_iterator begin() const { return std::data(m_values); }
+  const_iterator end() const { return std::data(m_values) + std::size(m_values); }
+
+  value_type &slot(size_t index) { return m_values[index]; }
+  const value_type &slot(size_t index) const { return m_values[index]; }
+  /// Slot indices and whether one holds an element, as of flat_map_t: elements are dense.
+  size_t slot_count() const noexcept { return size(); }
+  bool full(size_t index) const { return index < size(); }
+
+  /// Never: growth rehashes the index at once, it's cheap.
+  bool migrating() const noexcept { return false; }
+
+  /// Prefetches the first probed group (control bytes and element numbers) for the hash.
+  void prefetch(size_t hash) const {
+    size_t first = (hash_h1(hash) & group_mask()) * group_t::width;
+    _mm_prefetch(reinterpret_cast<const char *>(m_ctrl + first), _MM_HINT_T0);
+    _mm_prefetch(reinterpret_cast<const char *>(m_index + first), _MM_HINT_T0);
+  }
+
+  /// Returns number of the element that satisfies eq(key) or npos.
+  template <typename Eq>
+  size_t find_index(size_t hash, Eq &&eq) const {
+    size_t pos = probe(hash, [this, &eq](uint32_t index) { return eq(m_values[index].first); });
+    return pos != npos ? m_index[pos] : npos;
+  }
+  /// Single probe insertion, step 1: returns number of the element that satisfies eq(key) and
+  /// true, or index slot to insert the element into and false. In the last case the element must
+  /// be inserted with emplace_at() before any other modification of the map.
+  template <typename Eq>
+  std::pair<size_t, bool> find_or_prepare_insert(size_t hash, Eq &&eq);
+  /// Single probe insertion, step 2: appends value_type constructed from args, the prepared index
+  /// slot refers to it.
+  template <typename... Args>
+  value_type &emplace_at(size_t pos, size_t hash, Args &&... args) {
+    value_type &res = m_values.emplace_back(std::forward<Args>(args)...);
+    m_growth_left -= m_ctrl[pos] == ctrl_empty;
+    m_ctrl[pos] = hash_h2(hash);
+    m_index[pos] = uint32_t(size() - 1);
+    return res;
+  }
+
+  template <typename L>
+  value_type *find(const L &key) {
+    size_t index = find_index(Hash()(key), [&key](const K &k) { return k == key; });
+    return index != npos ? &m_values[index] : nullptr;
+  }
+
+  template <typename L>
+  bool erase(const L &key) {
+    size_t index = find_index(Hash()(key), [&key](const K &k) { return k == key; });
+    if (index == npos) return false;
+    erase_at(index);
+    return true;
+  }
+  void erase_at(size_t index);
+
+  /// Note: it's O(capacity), every key is rehashed.
+  flat_map_stats_t stats() const;
+  /// Index and elements, as stats().memory_bytes but O(1).
+  size_t memory_bytes() const noexcept {
+    return m_capacity * (sizeof(ctrl_t) + sizeof(uint32_t))
+      + m_values.capacity() * sizeof(value_type);
+  }
+
+private:
+  ctrl_t *m_ctrl;
+  uint32_t *m_index;  // element numbers of full index slots
+  size_t m_capacity;  // index slots: 0 or power of 2 not less than group width
+  size_t m_growth_left;  // insertions into empty index slots left before rehash
+  std::vector<value_type> m_values;
+
+  static constexpr size_t capacity_to_growth(size_t capacity) { return capacity - capacity / 8; }
+
+  size_t group_mask() const { return m_capacity ? m_capacity / group_t::width - 1 : 0; }
+  // Returns index slot that satisfies eq(element number) or npos.
+  template <typename Eq>
+  inline size_t ALWAYS_INLINE probe(size_t hash, Eq &&eq) const;
+  size_t find_first_non_full(size_t hash) const;
+  // Index slot of the element number
+  size_t position_of(uint32_t index) const {
+    return probe(Hash()(m_values[index].first), [index](uint32_t i) { return i == index; });
+  }
+  void rehash(size_t capacity);
+  void reset() noexcept {
+    m_ctrl = const_cast<ctrl_t *>(empty_group());
+    m_index = nullptr;
+    m_capacity = m_growth_left = 0;
+  }
+  void deallocate() noexcept {
+    if (!m_capacity) return;
+    ::operator delete(m_ctrl, std::align_val_t(group_t::width));
+    delete[] m_index;
+    reset();
+  }
+};
+
+template <typename K, typename T, typename Hash>
+template <typename Eq>
+size_t dense_map_t<K, T, Hash>::probe(size_t hash, Eq &&eq) const {
+  const ctrl_t h2 = hash_h2(hash);
+  const size_t mask = group_mask();
+  size_t g = hash_h1(hash) & mask;
+  for (size_t step = 1;; ++step) {
+    group_t group(m_ctrl + g * group_t::width);
+    for (auto m = group.match(h2); m; m &= m - 1) {
+      size_t pos = g * group_t::width + __builtin_ctz(m);
+      if (LIKELY(eq(m_index[pos]))) return pos;
+    }
+    if (LIKELY(group.match_empty())) return npos;
+    g = (g + step) & mask;
+  }
+}
+
+template <typename K, typename T, typename Hash>
+template <typename Eq>
+std::pair<size_t, bool> dense_map_t<K, T, Hash>::find_or_prepare_insert(size_t hash, Eq &&eq) {
+  const ctrl_t h2 = hash_h2(hash);
+  const size_t mask = group_mask();
+  size_t g = hash_h1(hash) & mask;
+  size_t target = npos;  // the first free index slot of the probe sequence
+  for (size_t step = 1;; ++step) {
+    group_t group(m_ctrl + g * group_t::width);
+    for (auto m = group.match(h2); m; m &= m - 1) {
+      size_t pos = g * group_t::width + __builtin_ctz(m);
+      if (LIKELY(eq(m_values[m_index[pos]].first))) return {m_index[pos], true};
+    }
+    if (target == npos) {
+      if (auto m = group.match_empty_or_deleted()) target = g * group_t::width + __builtin_ctz(m);
+    }
+    if (LIKELY(group.match_empty())) break;
+    g = (g + step) & mask;
+  }
+  // Reusing a tombstone does not consume growth
+  if (UNLIKELY(!m_growth_left && m_ctrl[target] != ctrl_deleted)) {
+    rehash(!m_capacity ? group_t::width
+           : size() >= capacity_to_growth(m_capacity) / 2 ? m_capacity * 2 : m_capacity);
+    target = find_first_non_full(hash);
+  }
+  return {target, false};
+}
+
+template <typename K, typename T, typename Hash>
+size_t dense_map_t<K, T, Hash>::find_first_non_full(size_t hash) const {
+  const size_t mask = group_mask();
+  size_t g = hash_h1(hash) & mask;
+  for (size_t step = 1;; ++step) {
+    auto m = group_t(m_ctrl + g * group_t::width).match_empty_or_deleted();
+    if (LIKELY(m)) return g * group_t::width + __builtin_ctz(m);
+    g = (g + step) & mask;
+  }
+}
+
+template <typename K, typename T, typename Hash>
+void dense_map_t<K, T, Hash>::erase_at(size_t index) {
+  size_t pos = position_of(uint32_t(index));
+  // A probe sequence never passes a group having an empty slot. So, if the group has one, the
+  // slot may become empty too, otherwise it must be a tombstone to keep longer sequences intact.
+  if (group_t(m_ctrl + pos / group_t::width * group_t::width).match_empty()) {
+    m_ctrl[pos] = ctrl_empty;
+    ++m_growth_left;
+  } else {
+    m_ctrl[pos] = ctrl_deleted;
+  }
+  size_t last = size() - 1;
+  if (index != last) {
+    m_index[position_of(uint32_t(last))] = uint32_t(index);
+    m_values[index] = std::move(m_values[last]);
+  }
+  m_values.pop_back();
+}
+
+template <typename K, typename T, typename Hash>
+flat_map_stats_t dense_map_t<K, T, Hash>::stats() const {
+  flat_map_stats_t res;
+  res.size = size();
+  res.capacity = m_capacity;
+  res.load_factor = m_capacity ? double(size()) / double(m_capacity) : 0;
+  res.memory_bytes = memory_bytes();
+  size_t total_length = 0;
+  const size_t mask = group_mask();
+  for (size_t i = 0; i < m_capacity; ++i) {
+    if (m_ctrl[i] == ctrl_deleted) ++res.tombstones;
+    if (m_ctrl[i] < 0) continue;
+    // Follows the probe sequence up to the element's group
+    size_t length = 1;
+    for (size_t g = hash_h1(Hash()(m_values[m_index[i]].first)) & mask; g != i / group_t::width;
+         g = (g + length++) & mask) {}
+    res.max_probe_length = std::max(res.max_probe_length, length);
+    ++res.probe_histogram[std::min(length, res.probe_histogram_size) - 1];
+    total_length += length;
+  }
+  res.avg_probe_length = size() ? double(total_length) / double(size()) : 0;
+  return res;
+}
+
+template <typename K, typename T, typename Hash>
+void dense_map_t<K, T, Hash>::rehash(size_t capacity) {
+  auto *ctrl = static_cast<ctrl_t *>(::operator new(capacity, std::align_val_t(group_t::width)));
+  memset(ctrl, ctrl_empty, capacity);
+  uint32_t *index;
+  try {
+    index = new uint32_t[capacity];
+  } catch (...) {
+    ::operator delete(ctrl, std::align_val_t(group_t::width));
+    throw;
+  }
+  deallocate();
+  m_ctrl = ctrl;
+  m_index = index;
+  m_capacity = capacity;
+  m_growth_left = capacity_to_growth(capacity) - size();
+  for (size_t i = 0; i < size(); ++i) {
+    size_t hash = Hash()(m_values[i].first);
+    size_t pos = find_first_non_full(hash);
+    m_ctrl[pos] = hash_h2(hash);
+    m_index[pos] = uint32_t(i);
+  }
+}
+
+} // detail::
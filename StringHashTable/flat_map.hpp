@@ -0,0 +1,683 @@
+/// \file
+/// \brief Flat open-addressing hash map with SIMD-probed control bytes
+
+#pragma once
+
+#include "utils.hpp"
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <iterator>
+#include <memory>
+#include <new>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <immintrin.h>
+
+namespace detail {
+
+// Every slot has a control byte: empty, deleted (tombstone) or full. A full slot's control byte
+// keeps 7 low bits of the key hash (h2), so most of mismatching slots are rejected by a group
+// compare without touching the slots themselves.
+using ctrl_t = int8_t;
+constexpr ctrl_t ctrl_empty = -128;  // 0b10000000
+constexpr ctrl_t ctrl_deleted = -2;  // 0b11111110
+
+inline ctrl_t ALWAYS_INLINE hash_h2(size_t hash) { return ctrl_t(hash & 0x7f); }
+// Group selector. Multiplication spreads all the hash bits (CRC32 gives only 32 of them) over
+// the bits masked to select a group.
+inline size_t ALWAYS_INLINE hash_h1(size_t hash) { return (hash * 0x9e3779b97f4a7c15ull) >> 32; }
+
+#if defined(__AVX2__)
+/// Group of control bytes probed at once (AVX2).
+struct group_t {
+  static constexpr size_t width = 32;
+  using mask_t = uint32_t;
+
+  explicit ALWAYS_INLINE group_t(const ctrl_t *pos)
+    : ctrl(_mm256_load_si256(reinterpret_cast<const __m256i *>(pos))) {}
+
+  mask_t ALWAYS_INLINE match(ctrl_t h2) const {
+    return _mm256_movemask_epi8(_mm256_cmpeq_epi8(ctrl, _mm256_set1_epi8(h2)));
+  }
+  mask_t ALWAYS_INLINE match_empty() const { return match(ctrl_empty); }
+  // Both empty and deleted have the high bit set
+  mask_t ALWAYS_INLINE match_empty_or_deleted() const { return _mm256_movemask_epi8(ctrl); }
+
+  __m256i ctrl;
+};
+#else
+/// Group of control bytes probed at once (SSE2).
+struct group_t {
+  static constexpr size_t width = 16;
+  using mask_t = uint32_t;
+
+  explicit ALWAYS_INLINE group_t(const ctrl_t *pos)
+    : ctrl(_mm_load_si128(reinterpret_cast<const __m128i *>(pos))) {}
+
+  mask_t ALWAYS_INLINE match(ctrl_t h2) const {
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, _mm_set1_epi8(h2)));
+  }
+  mask_t ALWAYS_INLINE match_empty() const { return match(ctrl_empty); }
+  // Both empty and deleted have the high bit set
+  mask_t ALWAYS_INLINE match_empty_or_deleted() const { return _mm_movemask_epi8(ctrl); }
+
+  __m128i ctrl;
+};
+#endif
+
+// Control bytes of a map without allocated slots: probing stops at the very first group.
+inline const ctrl_t *empty_group() {
+  alignas(group_t::width) static const struct empty_group_t {
+    ctrl_t ctrl[group_t::width];
+    empty_group_t() { memset(ctrl, ctrl_empty, sizeof(ctrl)); }
+  } group;
+  return group.ctrl;
+}
+
+/// Mapped type of sets: slots of maps hold keys only, see slot_t.
+struct no_mapped_t {};
+
+/// Slot of a set: pair-like (first is the key, second is a shared no_mapped_t), but no bytes are
+/// spent on the mapped value.
+template <typename K>
+struct key_slot_t {
+  K first;
+  static inline no_mapped_t second;
+
+  key_slot_t(const key_slot_t &) = default;
+  key_slot_t(key_slot_t &&) = default;
+  key_slot_t &operator=(const key_slot_t &) = default;
+  key_slot_t &operator=(key_slot_t &&) = default;
+  template <typename... Args>
+  key_slot_t(std::piecewise_construct_t, std::tuple<Args...> key_args, std::tuple<>)
+    : first(std::make_from_tuple<K>(std::move(key_args))) {}
+
+  // Structured bindings: auto &[key, value] = slot
+  template <size_t I>
+  auto &get() { if constexpr (I == 0) return first; else return second; }
+  template <size_t I>
+  const auto &get() const { if constexpr (I == 0) return first; else return second; }
+};
+
+template <typename K, typename T>
+struct slot_type { using type = std::pair<K, T>; };
+template <typename K>
+struct slot_type<K, no_mapped_t> { using type = key_slot_t<K>; };
+/// Slot of maps: std::pair<K, T>, or key_slot_t<K> for sets.
+template <typename K, typename T>
+using slot_t = typename slot_type<K, T>::type;
+
+/// Occupancy and probing statistics of flat_map_t.
+struct flat_map_stats_t {
+  static constexpr size_t probe_histogram_size = 16;
+
+  size_t size = 0;
+  size_t capacity = 0;  // slots
+  size_t tombstones = 0;
+  double load_factor = 0;  // (size - old_size) / capacity
+  // Incremental rehashing: elements not migrated yet and slots of the previous arrays. The other
+  // fields but size and the probe lengths are of the current arrays only
+  size_t old_size = 0;
+  size_t old_capacity = 0;
+  // Probe length of an element is the number of groups probed to find it, 1 at best
+  size_t max_probe_length = 0;
+  double avg_probe_length = 0;
+  size_t probe_histogram[probe_histogram_size] = {};  // [i]: elements with probe length i + 1,
+                                                      // the last one counts longer too
+  size_t memory_bytes = 0;  // control bytes and slots
+};
+
+/// Flat open-addressing hash map (Swiss table layout). Key/value pairs live inline in a single
+/// slot array, a parallel array of control bytes is probed a group at a time. Groups are probed
+/// in triangular order, the load factor is kept under 7/8.
+/// Unlike std::unordered_map, pointers to elements are invalidated by rehashing, i.e. by any
+/// insertion.
+/// Incremental rehashing: growth allocates new arrays, but the elements are migrated from the
+/// previous ones a few groups per insertion, so no insertion pays for moving all of them. Lookups
+/// probe both arrays till the migration ends. reserve() and the like finish it at once.
+template <typename K, typename T, typename Hash, bool Incremental = false>
+class flat_map_t {
+public:
+  using key_type = K;
+  using mapped_type = T;
+  using value_type = slot_t<K, T>;
+
+  static constexpr size_t npos = size_t(-1);
+
+  template <bool Const>
+  class iterator_t {
+  public:
+    using iterator_category = std::forward_iterator_tag;
+    using value_type = flat_map_t::value_type;
+    using difference_type = ptrdiff_t;
+    using pointer = std::conditional_t<Const, const value_type *, value_type *>;
+    using reference = std::conditional_t<Const, const value_type &, value_type &>;
+
+    reference operator*() const { return *m_slot; }
+    pointer operator->() const { return m_slot; }
+    iterator_t &operator++() { ++m_ctrl; ++m_slot; skip_free(); return *this; }
+    iterator_t operator++(int) { iterator_t tmp = *this; ++*this; return tmp; }
+    bool operator==(const iterator_t &other) const { return m_ctrl == other.m_ctrl; }
+    bool operator!=(const iterator_t &other) const { return m_ctrl != other.m_ctrl; }
+
+  private:
+    friend class flat_map_t;
+    // Note: the previous arrays of incremental rehashing (if any) are iterated after the current
+    // ones.
+    iterator_t(const ctrl_t *ctrl, const ctrl_t *end, pointer slot,
+               const ctrl_t *next_ctrl = nullptr, const ctrl_t *next_end = nullptr,
+               pointer next_slot = nullptr)
+      : m_ctrl(ctrl), m_end(end), m_slot(slot), m_next_ctrl(next_ctrl), m_next_end(next_end),
+        m_next_slot(next_slot) { skip_free(); }
+    void skip_free() {
+      for (;;) {
+        while (m_ctrl != m_end && *m_ctrl < 0) { ++m_ctrl; ++m_slot; }
+        if (LIKELY(m_ctrl != m_end || !m_next_ctrl)) return;
+        m_ctrl = m_next_ctrl;
+        m_end = m_next_end;
+        m_slot = m_next_slot;
+        m_next_ctrl = nullptr;
+      }
+    }
+
+    const ctrl_t *m_ctrl;
+    const ctrl_t *m_end;
+    pointer m_slot;
+    const ctrl_t *m_next_ctrl;
+    const ctrl_t *m_next_end;
+    pointer m_next_slot;
+  };
+  using iterator = iterator_t<false>;
+  using const_iterator = iterator_t<true>;
+
+  flat_map_t() noexcept { reset(); }
+  flat_map_t(const flat_map_t &other);
+  flat_map_t(flat_map_t &&other) noexcept : flat_map_t() { swap(other); }
+  flat_map_t &operator=(flat_map_t other) noexcept { swap(other); return *this; }
+  ~flat_map_t() { deallocate(); }
+
+  void swap(flat_map_t &other) noexcept;
+
+  bool empty() const noexcept { return !m_size; }
+  size_t size() const noexcept { return m_size; }
+  size_t capacity() const noexcept { return m_capacity; }  // slots, not elements!
+  /// Elements the capacity holds (tombstones aside) without rehashing.
+  size_t max_load() const noexcept { return capacity_to_growth(m_capacity); }
+
+  void clear() noexcept;
+  void reserve(size_t elem_count);
+
+  iterator begin() {
+    return {m_ctrl, m_ctrl + m_capacity, m_slots, m_old_ctrl, m_old_ctrl + m_old_capacity,
+            m_old_slots};
+  }
+  iterator end() {
+    if (m_old_capacity) {
+      return {m_old_ctrl + m_old_capacity, m_old_ctrl + m_old_capacity,
+              m_old_slots + m_old_capacity};
+    }
+    return {m_ctrl + m_capacity, m_ctrl + m_capacity, m_slots + m_capacity};
+  }
+  const_iterator begin() const {
+    return {m_ctrl, m_ctrl + m_capacity, m_slots, m_old_ctrl, m_old_ctrl + m_old_capacity,
+            m_old_slots};
+  }
+  const_iterator end() const {
+    if (m_old_capacity) {
+      return {m_old_ctrl + m_old_capacity, m_old_ctrl + m_old_capacity,
+              m_old_slots + m_old_capacity};
+    }
+    return {m_ctrl + m_capacity, m_ctrl + m_capacity, m_slots + m_capacity};
+  }
+
+  // Note: indices of elements not migrated yet by incremental rehashing follow the current slots.
+  value_type &slot(size_t index) {
+    if constexpr (Incremental) {
+      if (UNLIKELY(index >= m_capacity)) return m_old_slots[index - m_capacity];
+    }
+    return m_slots[index];
+  }
+  const value_type &slot(size_t index) const {
+    return const_cast<flat_map_t *>(this)->slot(index);
+  }
+
+  /// Slot indices, the previous arrays' ones of incremental rehashing included.
+  size_t slot_count() const noexcept { return m_capacity + m_old_capacity; }
+  /// The slot holds an element.
+  bool full(size_t index) const {
+    if constexpr (Incremental) {
+      if (UNLIKELY(index >= m_capacity)) return m_old_ctrl[index - m_capacity] >= 0;
+    }
+    return m_ctrl[index] >= 0;
+  }
+
+  /// Incremental rehashing is in progress.
+  bool migrating() const noexcept { return m_old_capacity; }
+
+  /// Prefetches the first probed group (control bytes and slots) for the hash.
+  void prefetch(size_t hash) const {
+    size_t first = (hash_h1(hash) & group_mask()) * group_t::width;
+    _mm_prefetch(reinterpret_cast<const char *>(m_ctrl + first), _MM_HINT_T0);
+    _mm_prefetch(reinterpret_cast<const char *>(m_slots + first), _MM_HINT_T0);
+  }
+
+  /// Returns slot index of the element that satisfies eq(key) or npos.
+  template <typename Eq>
+  size_t find_index(size_t hash, Eq &&eq) const;
+  /// Single probe insertion, step 1: returns slot index of the element that satisfies eq(key)
+  /// and true, or slot index to insert the element into and false. In the last case the element
+  /// must be inserted with emplace_at() before any other modification of the map.
+  template <typename Eq>
+  std::pair<size_t, bool> find_or_prepare_insert(size_t hash, Eq &&eq);
+  /// Single probe insertion, step 2: constructs value_type from args in the prepared slot.
+  template <typename... Args>
+  value_type &emplace_at(size_t index, size_t hash, Args &&... args) {
+    construct_at(index, hash, std::forward<Args>(args)...);
+    if constexpr (Incremental) {
+      // Migrated elements go to free slots, the emplaced one stays in place
+      if (m_old_capacity) migrate(migration_step);
+    }
+    return m_slots[index];
+  }
+
+  // Note: L is either K or a lookup key comparable with K and having the same hash, so a key
+  // need not be converted to K (and copied) just to probe.
+  template <typename L>
+  value_type *find(const L &key) {
+    size_t index = find_index(Hash()(key), [&key](const K &k) { return k == key; });
+    return index != npos ? &slot(index) : nullptr;
+  }
+
+  template <typename... Args>
+  std::pair<value_type *, bool> try_emplace(const K &key, Args &&... args);
+
+  template <typename L>
+  bool erase(const L &key) {
+    size_t index = find_index(Hash()(key), [&key](const K &k) { return k == key; });
+    if (index == npos) return false;
+    erase_at(index);
+    return true;
+  }
+  void erase_at(size_t index);
+
+  /// Note: it's O(capacity), every key is rehashed.
+  flat_map_stats_t stats() const;
+  /// Control bytes and slots, as stats().memory_bytes but O(1).
+  size_t memory_bytes() const noexcept {
+    return (m_capacity + m_old_capacity) * (sizeof(ctrl_t) + sizeof(value_type));
+  }
+
+private:
+  ctrl_t *m_ctrl;
+  value_type *m_slots;
+  size_t m_capacity;  // 0 or power of 2 not less than group width
+  size_t m_size;  // including the elements not migrated yet
+  size_t m_growth_left;  // insertions into empty slots left before rehash
+  // Previous arrays of incremental rehashing, their slots [m_old_pos, m_old_capacity) are not
+  // migrated yet. Migrated slots are marked deleted.
+  ctrl_t *m_old_ctrl;
+  value_type *m_old_slots;
+  size_t m_old_capacity;  // 0 unless migrating
+  size_t m_old_pos;
+
+  // Slots migrated per insertion. The migration ends long before the next growth: it takes
+  // capacity / 32 insertions, while the arrays take at least 7/16 capacity ones.
+  static constexpr size_t migration_step = 32;
+
+  static constexpr size_t capacity_to_growth(size_t capacity) { return capacity - capacity / 8; }
+  static size_t growth_to_capacity(size_t elem_count);
+
+  size_t group_mask() const { return m_capacity ? m_capacity / group_t::width - 1 : 0; }
+  template <typename Eq>
+  static inline size_t ALWAYS_INLINE probe(const ctrl_t *ctrl, const value_type *slots,
+                                           size_t mask, size_t hash, Eq &eq);
+  size_t find_first_non_full(size_t hash) const;
+  template <typename... Args>
+  void construct_at(size_t index, size_t hash, Args &&... args);
+  void rehash(size_t capacity);
+  size_t grown_capacity() const {
+    return !m_capacity ? group_t::width
+      : m_size >= capacity_to_growth(m_capacity) / 2 ? m_capacity * 2 : m_capacity;
+  }
+  void rehash_for_insert() {
+    // Growth before the migration ends (e.g. a lot of tombstones) rehashes all at once
+    if (Incremental && m_capacity && !m_old_capacity) start_migration(grown_capacity());
+    else rehash(grown_capacity());
+  }
+  void start_migration(size_t capacity);
+  void migrate(size_t slot_count);
+  void reset() noexcept {
+    m_ctrl = const_cast<ctrl_t *>(empty_group());
+    m_slots = nullptr;
+    m_capacity = m_size = m_growth_left = 0;
+    m_old_ctrl = nullptr;
+    m_old_slots = nullptr;
+    m_old_capacity = m_old_pos = 0;
+  }
+  static void deallocate(ctrl_t *ctrl, value_type *slots, size_t capacity) noexcept;
+  void deallocate_old() noexcept;
+  void destroy_slots() noexcept;  // the current ones
+  void deallocate() noexcept;
+};
+
+template <typename K, typename T, typename Hash, bool Incremental>
+flat_map_t<K, T, Hash, Incremental>::flat_map_t(const flat_map_t &other) : flat_map_t() {
+  reserve(other.m_size);
+  for (const value_type &slot : other) {
+    size_t hash = Hash()(slot.first);
+    construct_at(find_first_non_full(hash), hash, slot);
+  }
+}
+
+template <typename K, typename T, typename Hash, bool Incremental>
+void flat_map_t<K, T, Hash, Incremental>::swap(flat_map_t &other) noexcept {
+  std::swap(m_ctrl, other.m_ctrl);
+  std::swap(m_slots, other.m_slots);
+  std::swap(m_capacity, other.m_capacity);
+  std::swap(m_size, other.m_size);
+  std::swap(m_growth_left, other.m_growth_left);
+  std::swap(m_old_ctrl, other.m_old_ctrl);
+  std::swap(m_old_slots, other.m_old_slots);
+  std::swap(m_old_capacity, other.m_old_capacity);
+  std::swap(m_old_pos, other.m_old_pos);
+}
+
+template <typename K, typename T, typename Hash, bool Incremental>
+void flat_map_t<K, T, Hash, Incremental>::clear() noexcept {
+  deallocate_old();
+  if (!m_capacity) return;
+  destroy_slots();
+  memset(m_ctrl, ctrl_empty, m_capacity);
+  m_size = 0;
+  m_growth_left = capacity_to_growth(m_capacity);
+}
+
+template <typename K, typename T, typename Hash, bool Incremental>
+size_t flat_map_t<K, T, Hash, Incremental>::growth_to_capacity(size_t elem_count) {
+  size_t capacity = group_t::width;
+  while (capacity_to_growth(capacity) < elem_count) {
+    capacity <<= 1;
+  }
+  return capacity;
+}
+
+template <typename K, typename T, typename Hash, bool Incremental>
+void flat_map_t<K, T, Hash, Incremental>::reserve(size_t elem_count) {
+  if (elem_count <= m_size + m_growth_left && !m_old_capacity) return;
+  size_t capacity = growth_to_capacity(elem_count);
+  // Same capacity just drops tombstones (and ends migration)
+  rehash(capacity > m_capacity ? capacity : m_capacity);
+}
+
+template <typename K, typename T, typename Hash, bool Incremental>
+template <typename Eq>
+size_t flat_map_t<K, T, Hash, Incremental>::probe(const ctrl_t *ctrl, const value_type *slots,
+                                                  size_t mask, size_t hash, Eq &eq) {
+  const ctrl_t h2 = hash_h2(hash);
+  size_t g = hash_h1(hash) & mask;
+  for (size_t step = 1;; ++step) {
+    group_t group(ctrl + g * group_t::width);
+    for (auto m = group.match(h2); m; m &= m - 1) {
+      size_t index = g * group_t::width + __builtin_ctz(m);
+      if (LIKELY(eq(slots[index].first))) return index;
+    }
+    if (LIKELY(group.match_empty())) return npos;
+    g = (g + step) & mask;
+  }
+}
+
+template <typename K, typename T, typename Hash, bool Incremental>
+template <typename Eq>
+size_t flat_map_t<K, T, Hash, Incremental>::find_index(size_t hash, Eq &&eq) const {
+  size_t index = probe(m_ctrl, m_slots, group_mask(), hash, eq);
+  if constexpr (Incremental) {
+    if (index == npos && UNLIKELY(m_old_capacity)) {
+      index = probe(m_old_ctrl, m_old_slots, m_old_capacity / group_t::width - 1, hash, eq);
+      if (index != npos) index += m_capacity;
+    }
+  }
+  return index;
+}
+
+template <typename K, typename T, typename Hash, bool Incremental>
+template <typename Eq>
+std::pair<size_t, bool> flat_map_t<K, T, Hash, Incremental>::find_or_prepare_insert(size_t hash,
+                                                                                   Eq &&eq) {
+  const ctrl_t h2 = hash_h2(hash);
+  const size_t mask = group_mask();
+  size_t g = hash_h1(hash) & mask;
+  size_t target = npos;  // the first free slot of the probe sequence
+  for (size_t step = 1;; ++step) {
+    group_t group(m_ctrl + g * group_t::width);
+    for (auto m = group.match(h2); m; m &= m - 1) {
+      size_t index = g * group_t::width + __builtin_ctz(m);
+      if (LIKELY(eq(m_slots[index].first))) return {index, true};
+    }
+    if (target == npos) {
+      if (auto m = group.match_empty_or_deleted()) target = g * group_t::width + __builtin_ctz(m);
+    }
+    if (LIKELY(group.match_empty())) break;
+    g = (g + step) & mask;
+  }
+  if constexpr (Incremental) {
+    if (UNLIKELY(m_old_capacity)) {
+      size_t index = probe(m_old_ctrl, m_old_slots, m_old_capacity / group_t::width - 1, hash, eq);
+      if (index != npos) return {m_capacity + index, true};
+    }
+  }
+  // Reusing a tombstone does not consume growth
+  if (UNLIKELY(!m_growth_left && m_ctrl[target] != ctrl_deleted)) {
+    rehash_for_insert();
+    target = find_first_non_full(hash);
+  }
+  return {target, false};
+}
+
+template <typename K, typename T, typename Hash, bool Incremental>
+size_t flat_map_t<K, T, Hash, Incremental>::find_first_non_full(size_t hash) const {
+  const size_t mask = group_mask();
+  size_t g = hash_h1(hash) & mask;
+  for (size_t step = 1;; ++step) {
+    auto m = group_t(m_ctrl + g * group_t::width).match_empty_or_deleted();
+    if (LIKELY(m)) return g * group_t::width + __builtin_ctz(m);
+    g = (g + step) & mask;
+  }
+}
+
+template <typename K, typename T, typename Hash, bool Incremental>
+template <typename... Args>
+void flat_map_t<K, T, Hash, Incremental>::construct_at(size_t index, size_t hash, Args &&... args) {
+  new (m_slots + index) value_type(std::forward<Args>(args)...);
+  m_growth_left -= m_ctrl[index] == ctrl_empty;
+  m_ctrl[index] = hash_h2(hash);
+  ++m_size;
+}
+
+template <typename K, typename T, typename Hash, bool Incremental>
+template <typename... Args>
+std::pair<typename flat_map_t<K, T, Hash, Incremental>::value_type *, bool>
+flat_map_t<K, T, Hash, Incremental>::try_emplace(
+  const K &key, Args &&... args) {
+  size_t hash = Hash()(key);
+  auto [index, found] = find_or_prepare_insert(hash, [&key](const K &k) { return k == key; });
+  if (found) return {&slot(index), false};
+  value_type &res = emplace_at(index, hash, std::piecewise_construct, std::forward_as_tuple(key),
+                               std::forward_as_tuple(std::forward<Args>(args)...));
+  return {&res, true};
+}
+
+template <typename K, typename T, typename Hash, bool Incremental>
+void flat_map_t<K, T, Hash, Incremental>::erase_at(size_t index) {
+  if constexpr (Incremental) {
+    if (UNLIKELY(index >= m_capacity)) {  // not migrated yet
+      index -= m_capacity;
+      m_old_slots[index].~value_type();
+      m_old_ctrl[index] = ctrl_deleted;
+      --m_size;
+      return;
+    }
+  }
+  m_slots[index].~value_type();
+  --m_size;
+  // A probe sequence never passes a group having an empty slot. So, if the group has one, the
+  // slot may become empty too, otherwise it must be a tombstone to keep longer sequences intact.
+  if (group_t(m_ctrl + index / group_t::width * group_t::width).match_empty()) {
+    m_ctrl[index] = ctrl_empty;
+    ++m_growth_left;
+  } else {
+    m_ctrl[index] = ctrl_deleted;
+  }
+}
+
+template <typename K, typename T, typename Hash, bool Incremental>
+flat_map_stats_t flat_map_t<K, T, Hash, Incremental>::stats() const {
+  flat_map_stats_t res;
+  res.size = m_size;
+  res.capacity = m_capacity;
+  res.old_capacity = m_old_capacity;
+  res.memory_bytes = memory_bytes();
+  size_t total_length = 0;
+  // Returns the elements. Migrated slots of the previous arrays are marked deleted too, so
+  // tombstones are of the current arrays only.
+  auto add = [&res, &total_length](const ctrl_t *ctrl, const value_type *slots, size_t capacity,
+                                   size_t *tombstones) {
+    const size_t mask = capacity / group_t::width - 1;
+    size_t count = 0;
+    for (size_t i = 0; i < capacity; ++i) {
+      if (tombstones && ctrl[i] == ctrl_deleted) ++*tombstones;
+      if (ctrl[i] < 0) continue;
+      ++count;
+      // Follows the probe sequence up to the element's group
+      size_t length = 1;
+      for (size_t g = hash_h1(Hash()(slots[i].first)) & mask; g != i / group_t::width;
+           g = (g + length++) & mask) {}
+      res.max_probe_length = std::max(res.max_probe_length, length);
+      ++res.probe_histogram[std::min(length, res.probe_histogram_size) - 1];
+      total_length += length;
+    }
+    return count;
+  };
+  size_t current_size = add(m_ctrl, m_slots, m_capacity, &res.tombstones);
+  res.old_size = add(m_old_ctrl, m_old_slots, m_old_capacity, nullptr);
+  res.load_factor = m_capacity ? double(current_size) / double(m_capacity) : 0;
+  res.avg_probe_length = m_size ? double(total_length) / double(m_size) : 0;
+  return res;
+}
+
+template <typename K, typename T, typename Hash, bool Incremental>
+void flat_map_t<K, T, Hash, Incremental>::rehash(size_t capacity) {
+  auto *ctrl = static_cast<ctrl_t *>(::operator new(capacity, std::align_val_t(group_t::width)));
+  memset(ctrl, ctrl_empty, capacity);
+  value_type *slots;
+  try {
+    slots = std::allocator<value_type>().allocate(capacity);
+  } catch (...) {
+    ::operator delete(ctrl, std::align_val_t(group_t::width));
+    throw;
+  }
+  flat_map_t old(std::move(*this));
+  m_ctrl = ctrl;
+  m_slots = slots;
+  m_capacity = capacity;
+  m_growth_left = capacity_to_growth(capacity);
+  for (value_type &slot : old) {
+    size_t hash = Hash()(slot.first);
+    construct_at(find_first_non_full(hash), hash, std::move(slot));
+  }
+}
+
+template <typename K, typename T, typename Hash, bool Incremental>
+void flat_map_t<K, T, Hash, Incremental>::start_migration(size_t capacity) {
+  auto *ctrl = static_cast<ctrl_t *>(::operator new(capacity, std::align_val_t(group_t::width)));
+  memset(ctrl, ctrl_empty, capacity);
+  value_type *slots;
+  try {
+    slots = std::allocator<value_type>().allocate(capacity);
+  } catch (...) {
+    ::operator delete(ctrl, std::align_val_t(group_t::width));
+    throw;
+  }
+  m_old_ctrl = m_ctrl;
+  m_old_slots = m_slots;
+  m_old_capacity = m_capacity;
+  m_old_pos = 0;
+  m_ctrl = ctrl;
+  m_slots = slots;
+  m_capacity = capacity;
+  m_growth_left = capacity_to_growth(capacity);
+}
+
+template <typename K, typename T, typename Hash, bool Incremental>
+void flat_map_t<K, T, Hash, Incremental>::migrate(size_t slot_count) {
+  size_t end = std::min(m_old_pos + slot_count, m_old_capacity);
+  for (; m_old_pos < end; ++m_old_pos) {
+    if (m_old_ctrl[m_old_pos] < 0) continue;
+    // Tombstones may exhaust growth before the migration ends, the next insertion rehashes all
+    if (UNLIKELY(!m_growth_left)) return;
+    value_type &slot = m_old_slots[m_old_pos];
+    size_t hash = Hash()(slot.first);
+    construct_at(find_first_non_full(hash), hash, std::move(slot));
+    --m_size;  // already counted
+    slot.~value_type();
+    m_old_ctrl[m_old_pos] = ctrl_deleted;
+  }
+  if (m_old_pos == m_old_capacity) deallocate_old();
+}
+
+template <typename K, typename T, typename Hash, bool Incremental>
+void flat_map_t<K, T, Hash, Incremental>::destroy_slots() noexcept {
+  if constexpr (!std::is_trivially_destructible_v<value_type>) {
+    for (size_t i = 0; i < m_capacity; ++i) {
+      if (m_ctrl[i] >= 0) m_slots[i].~value_type();
+    }
+  }
+}
+
+template <typename K, typename T, typename Hash, bool Incremental>
+void flat_map_t<K, T, Hash, Incremental>::deallocate(ctrl_t *ctrl, value_type *slots,
+                                                     size_t capacity) noexcept {
+  ::operator delete(ctrl, std::align_val_t(group_t::width));
+  std::allocator<value_type>().deallocate(slots, capacity);
+}
+
+template <typename K, typename T, typename Hash, bool Incremental>
+void flat_map_t<K, T, Hash, Incremental>::deallocate_old() noexcept {
+  if (!m_old_capacity) return;
+  if constexpr (!std::is_trivially_destructible_v<value_type>) {
+    for (size_t i = m_old_pos; i < m_old_capacity; ++i) {
+      if (m_old_ctrl[i] >= 0) m_old_slots[i].~value_type();
+    }
+  }
+  deallocate(m_old_ctrl, m_old_slots, m_old_capacity);
+  m_old_ctrl = nullptr;
+  m_old_slots = nullptr;
+  m_old_capacity = m_old_pos = 0;
+}
+
+template <typename K, typename T, typename Hash, bool Incremental>
+void flat_map_t<K, T, Hash, Incremental>::deallocate() noexcept {
+  if (!m_capacity) return;
+  deallocate_old();
+  destroy_slots();
+  deallocate(m_ctrl, m_slots, m_capacity);
+  reset();
+}
+
+} // detail::
+
+namespace std {
+
+template <typename K>
+struct tuple_size<detail::key_slot_t<K>> : integral_constant<size_t, 2> {};
+template <typename K>
+struct tuple_element<0, detail::key_slot_t<K>> { using type = K; };
+template <typename K>
+struct tuple_element<1, detail::key_slot_t<K>> { using type = detail::no_mapped_t; };
+
+} // std::
+
+
+/* ==TRASH==
+*/
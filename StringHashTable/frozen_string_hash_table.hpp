@@ -0,0 +1,176 @@
+/// \file
+/// \brief Immutable string hash table over minimal perfect hashes
+
+#pragma once
+
+#include "perfect_map.hpp"
+#include "string_hash_table.hpp"
+#include <cstring>
+#include <initializer_list>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+/// Immutable hash table with string keys, e.g. keyword or header name sets fixed at startup.
+/// Keys are split into the size classes of string_hash_table_t (short keys are inline, long ones
+/// refer to a single chars buffer), every class is a detail::perfect_map_t over the hasher_t
+/// hashes. So a lookup hashes the key once and accesses exactly one slot, there is no probing and
+/// no key variant is made. Being immutable, the table is shared by threads without locking.
+/// The table is built at run time: hashes of long keys come from the hash kernel of the process
+/// (see hash_kernel()), so they are not known at compile time.
+template <typename T>
+class frozen_string_hash_table_t {
+public:
+  using mapped_type = T;
+
+  frozen_string_hash_table_t() = default;
+  /// Builds the table of (keys[i], values[i]) for i in [0, count). Throws std::runtime_error on
+  /// duplicate keys. Keys of a class with equal 32-bit hashes (a chance of about count^2 / 2^33)
+  /// are fine, see detail::perfect_map_t.
+  frozen_string_hash_table_t(const std::string_view *keys, const mapped_type *values,
+                             size_t count);
+  frozen_string_hash_table_t(std::initializer_list<std::pair<std::string_view, mapped_type>> elems);
+  // Long keys refer to m_chars
+  frozen_string_hash_table_t(const frozen_string_hash_table_t &) = delete;
+  frozen_string_hash_table_t(frozen_string_hash_table_t &&) = default;
+  frozen_string_hash_table_t &operator=(const frozen_string_hash_table_t &) = delete;
+  frozen_string_hash_table_t &operator=(frozen_string_hash_table_t &&) = default;
+
+  bool empty() const noexcept { return !size(); }
+  size_t size() const noexcept {
+    return m0.size() + m1.size() + m2.size() + m3.size() + ms.size();
+  }
+  size_t memory_bytes() const noexcept {
+    return m0.memory_bytes() + m1.memory_bytes() + m2.memory_bytes() + m3.memory_bytes()
+      + ms.memory_bytes() + m_chars_size;
+  }
+
+  const mapped_type *find(std::string_view key) const;
+  bool contains(std::string_view key) const { return find(key); }
+
+  /// Calls f(std::string_view, const mapped_type &) for every element.
+  template <typename F>
+  void for_each(F &&f) const;
+
+private:
+  template <typename K>
+  using map_t = detail::perfect_map_t<K, T, detail::hasher_t>;
+
+  map_t<detail::string_key0> m0;
+  map_t<detail::string_key8> m1;
+  map_t<detail::string_key16> m2;
+  map_t<detail::string_key24> m3;
+  map_t<detail::string_key_ref> ms;
+  std::unique_ptr<char[]> m_chars;  // of long keys
+  size_t m_chars_size = 0;
+
+  template <typename Values>
+  void build(const std::string_view *keys, size_t count, Values &&values);
+  template <typename K>
+  static map_t<K> make_map(std::vector<std::pair<K, T>> elems);
+  template <typename Slot>
+  static const mapped_type *value_of(const Slot *slot) { return slot ? &slot->second : nullptr; }
+};
+
+template <typename T>
+frozen_string_hash_table_t<T>::frozen_string_hash_table_t(const std::string_view *keys,
+                                                          const mapped_type *values,
+                                                          size_t count) {
+  build(keys, count, [values](size_t i) -> const mapped_type & { return values[i]; });
+}
+
+template <typename T>
+frozen_string_hash_table_t<T>::frozen_string_hash_table_t(
+  std::initializer_list<std::pair<std::string_view, mapped_type>> elems) {
+  std::vector<std::string_view> keys;
+  keys.reserve(std::size(elems));
+  for (const auto &elem : elems) keys.push_back(elem.first);
+  build(std::data(keys), std::size(keys), [&elems](size_t i) -> const mapped_type & {
+    return std::begin(elems)[i].second;
+  });
+}
+
+template <typename T>
+template <typename Values>
+void frozen_string_hash_table_t<T>::build(const std::string_view *keys, size_t count,
+                                          Values &&values) {
+  m_chars_size = 0;
+  for (size_t i = 0; i < count; ++i) {
+    if (detail::map_size_to_key_type(std::size(keys[i])) == detail::key_type_str) {
+      m_chars_size += std::size(keys[i]);
+    }
+  }
+  m_chars.reset(new char[m_chars_size]);
+  char *chars = m_chars.get();
+  std::vector<std::pair<detail::string_key0, T>> elems0;
+  std::vector<std::pair<detail::string_key8, T>> elems8;
+  std::vector<std::pair<detail::string_key16, T>> elems16;
+  std::vector<std::pair<detail::string_key24, T>> elems24;
+  std::vector<std::pair<detail::string_key_ref, T>> elems_str;
+  for (size_t i = 0; i < count; ++i) {
+    std::string_view sv = keys[i];
+    switch (detail::map_size_to_key_type(std::size(sv))) {
+      case detail::key_type0: elems0.emplace_back(detail::string_key0(), values(i)); break;
+      case detail::key_type8: elems8.emplace_back(detail::to_string_key8(sv), values(i)); break;
+      case detail::key_type16:
+        elems16.emplace_back(detail::to_string_key16(sv), values(i));
+        break;
+      case detail::key_type24:
+        elems24.emplace_back(detail::to_string_key24(sv), values(i));
+        break;
+      case detail::key_type_str:
+        memcpy(chars, std::data(sv), std::size(sv));
+        elems_str.emplace_back(
+          detail::string_key_ref{detail::to_string_key_head(sv, detail::hash(sv)), chars},
+          values(i));
+        chars += std::size(sv);
+        break;
+      default: UNREACHABLE();
+    }
+  }
+  m0 = make_map(std::move(elems0));
+  m1 = make_map(std::move(elems8));
+  m2 = make_map(std::move(elems16));
+  m3 = make_map(std::move(elems24));
+  ms = make_map(std::move(elems_str));
+}
+
+template <typename T>
+template <typename K>
+typename frozen_string_hash_table_t<T>::template map_t<K> frozen_string_hash_table_t<T>::make_map(
+  std::vector<std::pair<K, T>> elems) {
+  const K *key = map_t<K>::duplicate(elems, [](const K &a, const K &b) {
+    return detail::to_string_view(a) == detail::to_string_view(b);
+  });
+  if (key) error("Duplicate key: %s", std::string(detail::to_string_view(*key)).c_str());
+  return map_t<K>(std::move(elems));
+}
+
+template <typename T>
+const typename frozen_string_hash_table_t<T>::mapped_type *frozen_string_hash_table_t<T>::find(
+  std::string_view key) const {
+  switch (detail::map_size_to_key_type(std::size(key))) {
+    case detail::key_type0: return value_of(m0.find(detail::string_key0()));
+    case detail::key_type8: return value_of(m1.find(detail::to_string_key8(key)));
+    case detail::key_type16: return value_of(m2.find(detail::to_string_key16(key)));
+    case detail::key_type24: return value_of(m3.find(detail::to_string_key24(key)));
+    case detail::key_type_str: return value_of(ms.find(detail::to_string_key_view(key)));
+    default: UNREACHABLE();
+  }
+}
+
+template <typename T>
+template <typename F>
+void frozen_string_hash_table_t<T>::for_each(F &&f) const {
+  for (const auto &[key, value] : m0) f(detail::to_string_view(key), value);
+  for (const auto &[key, value] : m1) f(detail::to_string_view(key), value);
+  for (const auto &[key, value] : m2) f(detail::to_string_view(key), value);
+  for (const auto &[key, value] : m3) f(detail::to_string_view(key), value);
+  for (const auto &[key, value] : ms) f(detail::to_string_view(key), value);
+}
+
+
+/* ==TRASH==
+*/
@@ -0,0 +1,202 @@
+/// \file
+/// \brief CRC32 based hashing of string keys
+
+#pragma once
+
+#include "utils.hpp"
+#include <cstdint>
+#include <cstring>
+#include <immintrin.h>
+
+namespace detail {
+
+// CRC32C (Castagnoli) of 8 bytes, the same as SSE4.2 crc32 instruction computes. Software version
+// uses slicing by 8.
+
+struct crc32c_table_t {
+  uint32_t t[8][256];
+
+  constexpr crc32c_table_t() : t() {
+    for (uint32_t i = 0; i < 256; ++i) {
+      uint32_t crc = i;
+      for (int k = 0; k < 8; ++k) {
+        crc = crc & 1 ? (crc >> 1) ^ 0x82f63b78 : crc >> 1;
+      }
+      t[0][i] = crc;
+    }
+    for (int j = 1; j < 8; ++j) {
+      for (uint32_t i = 0; i < 256; ++i) {
+        t[j][i] = (t[j - 1][i] >> 8) ^ t[0][t[j - 1][i] & 0xff];
+      }
+    }
+  }
+};
+
+inline constexpr crc32c_table_t crc32c_table;
+
+constexpr uint32_t crc32_u64_soft(uint32_t crc, uint64_t value) {
+  value ^= crc;
+  const auto &t = crc32c_table.t;
+  return t[7][value & 0xff] ^ t[6][(value >> 8) & 0xff] ^ t[5][(value >> 16) & 0xff]
+    ^ t[4][(value >> 24) & 0xff] ^ t[3][(value >> 32) & 0xff] ^ t[2][(value >> 40) & 0xff]
+    ^ t[1][(value >> 48) & 0xff] ^ t[0][value >> 56];
+}
+
+// Inline hashing of short keys: SSE4.2 is a compile-time choice.
+inline uint32_t ALWAYS_INLINE crc32_u64(uint32_t crc, uint64_t value) {
+#if defined(__SSE4_2__)
+  return uint32_t(_mm_crc32_u64(crc, value));
+#else
+  return crc32_u64_soft(crc, value);
+#endif
+}
+
+// Hash kernels for long (> 24 chars) keys. They are not inlined, the kernel is chosen once at
+// startup by CPUID (see hash_kernel()). All the kernels give 32-bit hashes.
+
+struct crc32_soft_t {
+  static uint32_t ALWAYS_INLINE u64(uint32_t crc, uint64_t value) {
+    return crc32_u64_soft(crc, value);
+  }
+};
+
+struct crc32_asm_t {
+  // Note: inline asm rather than the intrinsic, so the kernel is compilable without SSE4.2
+  // enabled (and so inlinable into a generic template). It's run on SSE4.2 capable CPUs only.
+  static uint32_t ALWAYS_INLINE u64(uint32_t crc, uint64_t value) {
+    uint64_t res = crc;
+    asm("crc32q %1, %0" : "+r"(res) : "rm"(value));
+    return uint32_t(res);
+  }
+};
+
+inline uint64_t ALWAYS_INLINE load_u64(const char *p) {
+  uint64_t res;
+  memcpy(&res, p, 8);
+  return res;
+}
+
+// 3-way interleaved CRC32: three independent chains hide the latency of crc32 instruction (3
+// cycles, 1 cycle throughput). The chains are combined at the end. Note: the chains advance by
+// the same linear map, so a linear combine (e.g. xor) lets a change in one chain cancel out the
+// same change one word apart in another. Two chains are combined by multiplication instead.
+template <typename Crc>
+inline uint32_t ALWAYS_INLINE hash_crc3(const char *data, size_t size) {
+  uint32_t c0 = uint32_t(-1);
+  uint32_t c1 = 0x9e3779b9;
+  uint32_t c2 = 0x7f4a7c15;
+  const char *p = data;
+  const char *end = data + size;
+  while (end - p > 24) {
+    c0 = Crc::u64(c0, load_u64(p));
+    c1 = Crc::u64(c1, load_u64(p + 8));
+    c2 = Crc::u64(c2, load_u64(p + 16));
+    p += 24;
+  }
+  // The last 1..24 chars: the last 24 chars are hashed (some of them again), size > 24
+  c0 = Crc::u64(c0, load_u64(end - 24));
+  c1 = Crc::u64(c1, load_u64(end - 16));
+  c2 = Crc::u64(c2, load_u64(end - 8));
+  uint32_t res = Crc::u64(c0, (uint64_t(c1) << 32 | c2) * 0x9e3779b97f4a7c15ull);
+  return Crc::u64(res, size);
+}
+
+inline uint32_t hash_crc3_soft(const char *data, size_t size) {
+  return hash_crc3<crc32_soft_t>(data, size);
+}
+
+inline uint32_t hash_crc3_sse42(const char *data, size_t size) {
+  return hash_crc3<crc32_asm_t>(data, size);
+}
+
+// Wide hash: AES rounds over 64 bytes per iteration in two 256-bit lanes (VAES).
+__attribute__((target("avx2,aes,vaes")))
+inline uint32_t hash_vaes(const char *data, size_t size) {
+  const __m256i k0 = _mm256_set_epi64x(0x243f6a8885a308d3, 0x13198a2e03707344,
+                                       0xa4093822299f31d0, 0x082efa98ec4e6c89);
+  const __m256i k1 = _mm256_set_epi64x(0x452821e638d01377, 0xbe5466cf34e90c6c,
+                                       0xc0ac29b7c97c50dd, 0x3f84d5b5b5470917);
+  __m256i a = _mm256_xor_si256(k0, _mm256_set1_epi64x(int64_t(size)));
+  __m256i b = k1;
+  const char *p = data;
+  const char *end = data + size;
+  if (size >= 32) {
+    using chunk_t = const __m256i *;
+    while (end - p > 64) {
+      __m256i lo = _mm256_loadu_si256(reinterpret_cast<chunk_t>(p));
+      __m256i hi = _mm256_loadu_si256(reinterpret_cast<chunk_t>(p + 32));
+      a = _mm256_aesenc_epi128(_mm256_xor_si256(a, lo), k0);
+      b = _mm256_aesenc_epi128(_mm256_xor_si256(b, hi), k1);
+      p += 64;
+    }
+    // The last 1..64 chars: the last 32 or 64 chars are hashed (some of them again)
+    if (end - p > 32) {
+      __m256i lo = _mm256_loadu_si256(reinterpret_cast<chunk_t>(p));
+      a = _mm256_aesenc_epi128(_mm256_xor_si256(a, lo), k0);
+    }
+    __m256i hi = _mm256_loadu_si256(reinterpret_cast<chunk_t>(end - 32));
+    b = _mm256_aesenc_epi128(_mm256_xor_si256(b, hi), k1);
+  } else {  // 25..31 chars
+    __m128i lo = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data));
+    __m128i hi = _mm_loadu_si128(reinterpret_cast<const __m128i *>(end - 16));
+    b = _mm256_aesenc_epi128(_mm256_xor_si256(b, _mm256_set_m128i(hi, lo)), k1);
+  }
+  // Lane a gets one more round before combining, so that a change in it spreads over a column and
+  // cannot cancel out a single byte change in lane b.
+  a = _mm256_aesenc_epi128(a, k1);
+  __m256i x = _mm256_aesenc_epi128(_mm256_xor_si256(a, b), k0);
+  x = _mm256_aesenc_epi128(x, k1);
+  __m128i y = _mm_xor_si128(_mm256_castsi256_si128(x), _mm256_extracti128_si256(x, 1));
+  y = _mm_aesenc_si128(y, _mm256_castsi256_si128(k1));
+  y = _mm_aesenc_si128(y, _mm256_castsi256_si128(k0));
+  uint64_t res = uint64_t(_mm_cvtsi128_si64(y));
+  return uint32_t(res ^ (res >> 32));
+}
+
+enum hash_kernel_id {
+  hash_kernel_crc3_soft,  // scalar fallback
+  hash_kernel_crc3,       // SSE4.2, gives the same hashes as the scalar fallback
+  hash_kernel_vaes,       // AVX2 + VAES
+  hash_kernel_count
+};
+
+struct hash_kernel_t {
+  const char *name;
+  uint32_t (*fn)(const char *data, size_t size);
+};
+
+inline const hash_kernel_t hash_kernels[hash_kernel_count] = {
+  {"crc3_soft", hash_crc3_soft},
+  {"crc3", hash_crc3_sse42},
+  {"vaes", hash_vaes},
+};
+
+inline bool hash_kernel_supported(hash_kernel_id id) {
+  __builtin_cpu_init();
+  switch (id) {
+    case hash_kernel_crc3_soft: return true;
+    case hash_kernel_crc3: return __builtin_cpu_supports("sse4.2");
+    case hash_kernel_vaes:
+      return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("aes")
+        && __builtin_cpu_supports("vaes");
+    default: UNREACHABLE();
+  }
+}
+
+/// Hash kernel for long keys, the fastest one supported by CPU. It's chosen once per process, so
+/// hashes of long keys are stable within a process only.
+inline const hash_kernel_t &hash_kernel() {
+  static const hash_kernel_t &kernel = []() -> const hash_kernel_t & {
+    for (int id = hash_kernel_count - 1; id > hash_kernel_crc3_soft; --id) {
+      if (hash_kernel_supported(hash_kernel_id(id))) return hash_kernels[id];
+    }
+    return hash_kernels[hash_kernel_crc3_soft];
+  }();
+  return kernel;
+}
+
+} // detail::
+
+
+/* ==TRASH==
+*/
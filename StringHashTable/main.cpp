@@ -1,10 +1,27 @@
 /// \file
 /// \brief Application main file
 
+#include "concurrent_string_hash_table.hpp"
+#include "frozen_string_hash_table.hpp"
+#include "mapped_string_hash_table.hpp"
+#include "rcu_string_hash_table.hpp"
+#include "spilling_string_hash_table.hpp"
+#include "string_dictionary.hpp"
+#include "string_hash_cache.hpp"
+#include "string_hash_multimap.hpp"
+#include "string_hash_set.hpp"
 #include "string_hash_table.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
 #include <exception>
 #include <iostream>
+#include <random>
 #include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
 
 using namespace std::string_literals;
 using namespace std::string_view_literals;
@@ -255,9 +272,627 @@ void exec_test() {
   std::cerr << "**** Done\n";
 }
 
+// Checks long keys' hash kernels supported by CPU: the scalar fallback must agree with SSE4.2
+// CRC, single char changes must collide about as rare as random 32-bit values do and hashes of
+// similar keys must be spread evenly over groups (detail::hash_h1) and control bytes
+// (detail::hash_h2).
+bool exec_hash_quality();
+bool exec_hash_quality() {
+  std::mt19937_64 rnd(1);
+  bool ok = true;
+
+  std::string buf(300, ' ');
+  for (auto &c : buf) c = char(rnd());
+  for (size_t size = 25; size <= std::size(buf); ++size) {
+    std::string_view sv(std::data(buf), size);
+    if (detail::hash_kernel_supported(detail::hash_kernel_crc3)
+        && detail::hash_crc3_soft(std::data(sv), size) != detail::hash_crc3_sse42(std::data(sv), size)) {
+      std::cerr << "crc3: scalar fallback differs at size " << size << std::endl;
+      ok = false;
+    }
+  }
+
+  for (int id = 0; id < detail::hash_kernel_count; ++id) {
+    if (!detail::hash_kernel_supported(detail::hash_kernel_id(id))) continue;
+    const detail::hash_kernel_t &kernel = detail::hash_kernels[id];
+
+    // Every single char change of every position
+    size_t collisions = 0;
+    double expected_collisions = 0;
+    for (size_t size : {25, 31, 33, 48, 64, 100, 200}) {
+      double n = size * 255.0;
+      expected_collisions += n * (n - 1) / 2 / 4294967296.0;
+      std::unordered_set<uint32_t> hashes;
+      std::string key = buf.substr(0, size);
+      for (size_t pos = 0; pos < size; ++pos) {
+        char orig = key[pos];
+        for (int c = 0; c < 256; ++c) {
+          if (char(c) == orig) continue;
+          key[pos] = char(c);
+          collisions += !hashes.insert(kernel.fn(std::data(key), size)).second;
+        }
+        key[pos] = orig;
+      }
+    }
+
+    // Sequential keys over 4096 groups and 128 control byte values: chi-square per degree of
+    // freedom is about 1 for a uniform distribution.
+    static const size_t key_count = 1 << 18;
+    std::vector<size_t> groups(4096), h2s(128);
+    for (size_t i = 0; i < key_count; ++i) {
+      std::string key = format("https://example.com/catalog/item/%08zu", i);
+      uint32_t hash = kernel.fn(std::data(key), std::size(key));
+      ++groups[detail::hash_h1(hash) & (std::size(groups) - 1)];
+      ++h2s[detail::hash_h2(hash)];
+    }
+    auto chi2 = [](const std::vector<size_t> &counts) {
+      double expected = double(key_count) / std::size(counts);
+      double sum = 0;
+      for (size_t count : counts) sum += (count - expected) * (count - expected) / expected;
+      return sum / (std::size(counts) - 1);
+    };
+    double groups_chi2 = chi2(groups);
+    double h2_chi2 = chi2(h2s);
+
+    bool kernel_ok = collisions <= 4 && groups_chi2 < 1.5 && h2_chi2 < 1.5;
+    std::cerr << kernel.name << (&kernel == &detail::hash_kernel() ? " (selected)" : "")
+              << ": single char collisions = " << collisions << " (random: "
+              << expected_collisions << "), groups chi2 = " << groups_chi2
+              << ", h2 chi2 = " << h2_chi2 << (kernel_ok ? "" : " - FAILED") << std::endl;
+    ok = ok && kernel_ok;
+  }
+  return ok;
+}
+
+struct counting_options : string_hash_table_options {
+  static constexpr bool counters = true;
+  static constexpr bool long_key_filter = true;
+};
+
+bool exec_stats();
+bool exec_stats() {
+  string_hash_table_t<int, counting_options> sht;
+  std::mt19937 rnd(1);
+  for (int i = 0; i < 100000; ++i) {
+    std::string key(rnd() % 40, 'a');
+    for (char &c : key) c = char('a' + rnd() % 26);
+    sht[key] += 1;
+    sht.find(key + "#");  // miss
+  }
+
+  // Group-by sum of key lengths, a row at a time and a batch of rows at a time
+  std::vector<std::string> keys = {"apple", "pear", "apple", "a long key of more than 24 chars"};
+  std::vector<std::string_view> key_views(std::begin(keys), std::end(keys));
+  std::vector<int> lengths;
+  for (std::string_view key : key_views) lengths.push_back(int(std::size(key)));
+  auto add = [](int &sum, int value) { sum += value; };
+  string_hash_table_t<int> sums;
+  for (size_t i = 0; i < std::size(keys); ++i) sums.upsert(keys[i], lengths[i], add);
+  sums.accumulate(std::data(key_views), std::data(lengths), std::size(key_views), add);
+  std::cerr << "sum of apple = " << *sums.find("apple"sv) << ", groups = " << sums.size()
+            << std::endl;
+  bool ok = sums.size() == 3 && *sums.find("apple"sv) == 20 && *sums.find("pear"sv) == 8
+    && *sums.find(keys[3]) == 64;
+
+  // Group-by result as columns: keys (offsets + chars) and values
+  dense_string_hash_table_t<int> dense_sums;
+  dense_sums.accumulate(std::data(key_views), std::data(lengths), std::size(key_views), add);
+  dense_sums.erase("pear"sv);
+  std::vector<size_t> offsets(dense_sums.size() + 1);
+  std::vector<char> chars(dense_sums.key_chars_size() + 8);  // padded for column ingestion
+  std::vector<int> values(dense_sums.size());
+  dense_sums.export_columns(std::data(offsets), std::data(chars), std::data(values));
+  ok = ok && std::size(values) == 2;
+  for (size_t i = 0; i < std::size(values); ++i) {
+    std::string_view key(std::data(chars) + offsets[i], offsets[i + 1] - offsets[i]);
+    std::cerr << key << " -> " << values[i] << std::endl;
+    ok = ok && key != "pear" && *dense_sums.find(key) == values[i];
+  }
+
+  // Column ingestion: the exported columns are added into the table once again
+  dense_sums.accumulate_column(std::data(offsets), std::data(chars), std::size(values),
+                               std::data(values), add);
+  std::cerr << "sum of apple = " << *dense_sums.find("apple"sv) << std::endl;
+  ok = ok && dense_sums.size() == 2 && *dense_sums.find("apple"sv) == 20
+    && *dense_sums.find(keys[3]) == 64;
+
+  string_hash_table_stats_t stats = sht.stats();
+  for (size_t i = 0; i < stats.class_count; ++i) {
+    const detail::flat_map_stats_t &submap = stats.classes[i];
+    std::cerr << "class " << stats.class_names[i] << ": size = " << submap.size << ", capacity = "
+              << submap.capacity << ", load factor = " << submap.load_factor
+              << ", probe length avg/max = " << submap.avg_probe_length << '/'
+              << submap.max_probe_length << ", tombstones = " << submap.tombstones << std::endl;
+  }
+  std::cerr << "size = " << stats.size << ", key bytes = " << stats.key_bytes
+            << ", memory bytes = " << stats.memory_bytes << std::endl;
+  std::cerr << "hits = " << stats.counters.hits << ", misses = " << stats.counters.misses
+            << ", inserts = " << stats.counters.inserts << ", rehashes = "
+            << stats.counters.rehashes << std::endl;
+  const detail::block_filter_stats_t &filter = stats.long_key_filter;
+  std::cerr << "long key filter: bytes = " << filter.memory_bytes << ", estimated fpr = "
+            << filter.estimated_fpr << ", rejects = " << filter.rejects << ", false positives = "
+            << filter.false_positives << std::endl;
+  std::cerr << "group-by: " << (ok ? "ok" : "FAILED") << std::endl;
+  return ok;
+}
+
+bool exec_concurrent();
+bool exec_concurrent() {
+  // Threads count words into the same table
+  concurrent_string_hash_table_t<int> cht;
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 4; ++t) {
+    threads.emplace_back([&cht]() {
+      for (int i = 0; i < 10000; ++i) {
+        cht.try_emplace_visit("Key #" + std::to_string(i % 100), [](int &n) { ++n; }, 0);
+      }
+    });
+  }
+  for (std::thread &thread : threads) thread.join();
+
+  int total = 0;
+  cht.for_each([&total](string_hash_key_t &&, int n) { total += n; });
+  int key42 = 0;
+  cht.find("Key #42", [&key42](int n) { key42 = n; });
+  std::cerr << "Key #42 -> " << key42 << ", size = " << cht.size() << ", total = " << total
+            << std::endl;
+  bool ok = key42 == 400 && cht.size() == 100 && total == 40000;
+
+  // Parallel group-by: sum of rows by key
+  std::vector<std::string> keys;
+  for (int i = 0; i < 100000; ++i) keys.push_back("Key #" + std::to_string(i % 1000));
+  std::vector<std::string_view> key_views(std::begin(keys), std::end(keys));
+  concurrent_string_hash_table_t<int> sums;
+  sums.bulk_build(std::data(key_views), std::size(key_views), [](int &sum, size_t row) {
+    sum += int(row % 10);
+  });
+  auto sum_of = [](const concurrent_string_hash_table_t<int> &table, std::string_view key) {
+    int res = 0;
+    table.find(key, [&res](int sum) { res = sum; });
+    return res;
+  };
+  ok = ok && sum_of(sums, "Key #42") == 200 && sums.size() == 1000;
+
+  // Merge of partial aggregates
+  string_hash_table_t<int> partial;
+  partial["Key #42"] = 1000000;
+  partial["Key #1000"] = 1;
+  sums.merge(partial, [](int &sum, int value) { sum += value; });
+  std::cerr << "sum of Key #42 = " << sum_of(sums, "Key #42") << ", groups = " << sums.size()
+            << std::endl;
+  ok = ok && sum_of(sums, "Key #42") == 1000200 && sum_of(sums, "Key #1000") == 1
+    && sums.size() == 1001;
+
+  // Merge of a table into itself, then of tables into each other at once: either sees the other
+  // before or after its own merge, by shard
+  auto add = [](int &sum, int value) { sum += value; };
+  sums.merge(sums, add);
+  std::cerr << "sum of Key #42 = " << sum_of(sums, "Key #42") << std::endl;
+  ok = ok && sum_of(sums, "Key #42") == 2000400;
+  concurrent_string_hash_table_t<int> counts;
+  counts.bulk_build(std::data(key_views), std::size(key_views), [](int &n, size_t) { ++n; });
+  std::thread merging([&]() { counts.merge(sums, add); });
+  sums.merge(counts, add);
+  merging.join();
+  std::cerr << "groups = " << sums.size() << " and " << counts.size() << std::endl;
+  ok = ok && sums.size() == 1001 && counts.size() == 1001
+    && sum_of(sums, "Key #42") >= 2000500 && sum_of(counts, "Key #42") >= 2000500;
+  std::cerr << "concurrent: " << (ok ? "ok" : "FAILED") << std::endl;
+  return ok;
+}
+
+bool exec_snapshot();
+bool exec_snapshot() {
+  string_hash_table_t<int> sht;
+  for (int i = 0; i < 1000; ++i) sht["Key #" + std::to_string(i)] = i;
+  sht["a long key of more than 24 chars"] = -1;
+  sht[""] = -2;
+
+  // Save, then map read-only (as another process would)
+  const char *path = "StringHashTable.snapshot";
+  mapped_string_hash_table_t<int>::save(sht, path);
+  bool ok = false;
+  {
+    mapped_string_hash_table_t<int> mapped(path, true);
+    size_t matched = 0;
+    sht.for_each_hashed([&](std::string_view key, size_t, int value) {
+      const int *mapped_value = mapped.find(key);
+      matched += mapped_value && *mapped_value == value;
+    });
+    std::cerr << "mapped size = " << mapped.size() << ", matched = " << matched
+              << ", Key #1000 found: " << std::boolalpha << mapped.contains("Key #1000")
+              << std::endl;
+    ok = mapped.size() == sht.size() && matched == sht.size() && !mapped.contains("Key #1000")
+      && !mapped.contains("a long key of more than 24 chars, absent");
+    mapped_string_hash_table_t<int> moved(std::move(mapped));
+    ok = ok && moved.size() == sht.size() && mapped.empty() && !mapped.contains("Key #1");
+  }
+  std::remove(path);
+  return ok;
+}
+
+bool exec_spilling();
+bool exec_spilling() {
+  // Group-by count of 100000 distinct keys within 256KB: most of them are spilled
+  auto add = [](int &sum, int value) { sum += value; };
+  spilling_string_hash_table_t<int, decltype(add)> counts(256 * 1024, add);
+  for (int i = 0; i < 300000; ++i) {
+    counts.upsert("Key #" + std::to_string(i % 100000), 1);
+  }
+  size_t groups = 0;
+  int total = 0;
+  bool ok = true;
+  counts.finish([&](std::string_view, int count) {
+    ++groups;
+    total += count;
+    ok = ok && count == 3;
+  });
+  std::cerr << "groups = " << groups << ", total = " << total << ", spills = "
+            << counts.spill_count() << ", spilled bytes = " << counts.spilled_bytes() << std::endl;
+  return ok && groups == 100000 && total == 300000;
+}
+
+bool exec_join();
+bool exec_join() {
+  // Build side: orders by customer, probe side: customers
+  std::vector<std::string_view> order_customers = {"alice", "bob", "alice", "carol", "alice"};
+  std::vector<uint32_t> order_ids = {100, 101, 102, 103, 104};
+  string_hash_multimap_t<> orders;
+  orders.build(std::data(order_customers), std::data(order_ids), std::size(order_ids));
+
+  std::vector<std::string_view> customers = {"alice", "dave", "carol"};
+  string_hash_multimap_t<>::probe_cursor_t cursor;
+  size_t indices[2];  // small batches to show continuation
+  uint32_t rows[2];
+  std::vector<std::pair<size_t, uint32_t>> matches;
+  while (size_t n = orders.probe(std::data(customers), std::size(customers), cursor, indices,
+                                 rows, std::size(rows))) {
+    for (size_t i = 0; i < n; ++i) {
+      std::cerr << customers[indices[i]] << " -> order " << rows[i] << std::endl;
+      matches.emplace_back(indices[i], rows[i]);
+    }
+  }
+  // Rows of a key in build order, keys in probe order
+  const std::vector<std::pair<size_t, uint32_t>> expected = {{0, 100}, {0, 102}, {0, 104},
+                                                             {2, 103}};
+  bool ok = matches == expected;
+  auto [first, last] = orders.equal_range("bob");
+  ok = ok && last - first == 1 && *first == 101 && orders.size() == 5 && orders.key_count() == 3;
+  std::cerr << "join: " << (ok ? "ok" : "FAILED") << std::endl;
+  return ok;
+}
+
+bool exec_set();
+bool exec_set() {
+  // Distinct words, the set costs about a slot per short key
+  const std::string_view words[] = {"to", "be", "or", "not", "to", "be", "that", "is", "the",
+                                    "question", "whether", "tis", "nobler", "in", "the", "mind",
+                                    "to", "suffer"};
+  string_hash_set_t<> distinct;
+  bool inserted[std::size(words)];
+  distinct.insert_batch(words, std::size(words), inserted);
+  size_t duplicates = std::count(std::begin(inserted), std::end(inserted), false);
+  distinct.erase("not");
+  std::cerr << "distinct = " << distinct.size() << ", duplicates = " << duplicates
+            << ", contains 'not': " << std::boolalpha << distinct.contains("not") << std::endl;
+
+  string_hash_set_t<> keys;
+  for (int i = 0; i < 100000; ++i) keys.insert("Key #" + std::to_string(i));
+  std::cerr << "bytes per key = " << double(keys.memory_bytes()) / double(keys.size())
+            << std::endl;
+  bool ok = distinct.size() == 13 && duplicates == 4 && !distinct.contains("not")
+    && distinct.contains("question") && keys.size() == 100000 && keys.contains("Key #99999")
+    && !keys.contains("Key #100000");
+  std::cerr << "set: " << (ok ? "ok" : "FAILED") << std::endl;
+  return ok;
+}
+
+bool exec_dictionary();
+bool exec_dictionary() {
+  // Dictionary encoding of a column
+  const std::string_view colors[] = {"red", "green", "red", "a color with a rather long name",
+                                     "blue", "green", "a color with a rather long name"};
+  string_dictionary_t<> dictionary;
+  uint32_t ids[std::size(colors)];
+  dictionary.encode(colors, std::size(colors), ids);
+  for (uint32_t id : ids) std::cerr << id << ' ';
+  std::cerr << "-> " << dictionary.size() << " strings, id 3 = " << dictionary.lookup_id(3)
+            << std::endl;
+
+  // Round trip, with views of ids taken while more strings are interned
+  bool ok = dictionary.size() == 4;
+  std::vector<std::string_view> views;
+  for (size_t i = 0; i < std::size(colors); ++i) {
+    views.push_back(dictionary.lookup_id(ids[i]));
+    ok = ok && views.back() == colors[i];
+  }
+  for (int i = 0; i < 100000; ++i) {
+    std::string color = "color #" + std::to_string(i);
+    ok = ok && dictionary.lookup_id(dictionary.intern(color)) == color;
+  }
+  for (size_t i = 0; i < std::size(colors); ++i) {
+    ok = ok && views[i] == colors[i] && dictionary.find(colors[i]) == ids[i];
+  }
+  ok = ok && dictionary.find("purple") == dictionary.no_id;
+  std::cerr << "dictionary round trip: " << (ok ? "ok" : "FAILED") << std::endl;
+  return ok;
+}
+
+bool exec_cache();
+bool exec_cache() {
+  // Lengths of 1000 keys cached, lookups skewed to the first 100 keys
+  size_t evicted = 0;
+  auto evict = [&evicted](std::string_view, size_t &) { ++evicted; };
+  string_hash_cache_t<size_t, decltype(evict)> cache(1000, string_hash_cache_t<size_t>::unlimited,
+                                                     evict);
+  std::mt19937 rnd(1);
+  for (int i = 0; i < 100000; ++i) {
+    std::string key = "Key #" + std::to_string(rnd() % 2 ? rnd() % 100 : rnd() % 10000);
+    if (!cache.find(key)) cache.try_emplace(key, std::size(key));
+  }
+  const auto &counters = cache.counters();
+  std::cerr << "size = " << cache.size() << ", hit rate = "
+            << double(counters.hits) / double(counters.hits + counters.misses) << ", evicted = "
+            << evicted << std::endl;
+  bool ok = cache.size() == 1000 && evicted == counters.evictions
+    && counters.inserts == cache.size() + evicted;
+
+  // Second chance: of 3 entries the one not looked up is evicted
+  std::string evicted_key;
+  auto evict_key = [&evicted_key](std::string_view key, int &) { evicted_key = key; };
+  string_hash_cache_t<int, decltype(evict_key)> lru(3, string_hash_cache_t<int>::unlimited,
+                                                    evict_key);
+  for (std::string_view key : {"red", "green", "blue"}) lru.try_emplace(key, 0);
+  lru.find("red");
+  lru.find("blue");
+  lru.try_emplace("yellow", 0);
+  ok = ok && evicted_key == "green" && lru.size() == 3 && lru.contains("yellow");
+
+  // Byte budget of long keys: the entries fit it after every insertion
+  const size_t max_bytes = 4096;
+  string_hash_cache_t<int> budgeted(string_hash_cache_t<int>::unlimited, max_bytes);
+  for (int i = 0; i < 1000; ++i) {
+    budgeted.try_emplace("a long key of more than 24 chars #" + std::to_string(i), i);
+    ok = ok && budgeted.bytes() <= max_bytes;
+  }
+  ok = ok && budgeted.size() > 1 && budgeted.size() < 1000
+    && budgeted.contains("a long key of more than 24 chars #999");
+  std::cerr << "cache: " << (ok ? "ok" : "FAILED") << ", entries within " << max_bytes
+            << " bytes = " << budgeted.size() << std::endl;
+  return ok;
+}
+
+bool exec_frozen();
+bool exec_frozen() {
+  // HTTP header names, fixed at startup
+  static const frozen_string_hash_table_t<int> headers = {
+    {"content-type", 1}, {"content-length", 2}, {"host", 3}, {"accept", 4},
+    {"access-control-allow-credentials", 5}};
+  int found[3];
+  int i = 0;
+  for (std::string_view name : {"host", "accept-encoding", "access-control-allow-credentials"}) {
+    const int *id = headers.find(name);
+    std::cerr << name << " -> " << (id ? *id : 0) << std::endl;
+    found[i++] = id ? *id : 0;
+  }
+  bool ok = found[0] == 3 && found[1] == 0 && found[2] == 5 && headers.size() == 5
+    && !headers.contains("") && !headers.contains("access-control-allow-credentialz")
+    && !headers.contains("Host");
+
+  // Duplicates are rejected
+  try {
+    frozen_string_hash_table_t<int> duplicates = {{"host", 1}, {"host", 2}};
+    ok = false;
+  } catch (const std::runtime_error &) {}
+  std::cerr << "frozen: " << (ok ? "ok" : "FAILED") << std::endl;
+  return ok;
+}
+
+bool exec_rcu();
+bool exec_rcu() {
+  rcu_string_hash_table_t<std::string> rcu;
+  rcu.update([](auto &table) {
+    table.try_emplace("color", "red");
+    table.try_emplace("size", "large");
+  });
+
+  // A reader thread looks up snapshots, while the table is updated
+  std::atomic<bool> done = false;
+  std::atomic<bool> ok = true;
+  std::thread reader_thread([&rcu, &done, &ok]() {
+    auto reader = rcu.make_reader();
+    while (!done.load()) {
+      const std::string *color = reader.find("color");
+      if (!color || (*color != "red" && *color != "blue")) ok = false;
+      reader.quiescent();  // color must not be used after
+    }
+  });
+  rcu.update([](auto &table) { table.insert_or_assign("color", "blue"); });
+  done = true;
+  reader_thread.join();
+  rcu.reclaim();
+
+  auto reader = rcu.make_reader();
+  const std::string *color = reader.find("color");
+  const std::string *size = reader.find("size");
+  ok = ok && color && *color == "blue" && size && *size == "large" && !reader.find("shape");
+  std::cerr << "color = " << (color ? *color : "(none)") << ", retired = "
+            << rcu.retired_count() << ", rcu: " << (ok ? "ok" : "FAILED") << std::endl;
+  return ok;
+}
+
+struct adaptive_counting_options : counting_options {
+  static constexpr bool adaptive_reserve = true;
+};
+
+bool exec_reserve();
+bool exec_reserve() {
+  // Keys mostly long: 1000 of 1..8 chars, 2000 of 9..16, 0 of 17..24 and 20000 of > 24 chars
+  std::mt19937 rnd(1);
+  std::vector<std::string> keys;
+  size_t length_counts[64] = {};
+  auto add_keys = [&](size_t count, size_t min_length, size_t max_length) {
+    for (size_t i = 0; i < count; ++i) {
+      std::string key = std::to_string(i) + '#';
+      key.resize(std::max(std::size(key), min_length + rnd() % (max_length - min_length + 1)),
+                 'a');
+      ++length_counts[std::size(key)];
+      keys.push_back(std::move(key));
+    }
+  };
+  add_keys(1000, 1, 8);
+  add_keys(2000, 9, 16);
+  add_keys(20000, 25, 63);
+  bool ok = true;
+  // No rehash while filling, every class fits its keys
+  auto check = [&ok](const char *name, const string_hash_table_stats_t &stats,
+                     uint64_t rehashes) {
+    std::cerr << name << ": rehashes = " << rehashes << ", capacities =";
+    for (const detail::flat_map_stats_t &submap : stats.classes) {
+      std::cerr << ' ' << submap.capacity;
+      if (submap.capacity - submap.capacity / 8 < submap.size) ok = false;
+    }
+    std::cerr << std::endl;
+    if (rehashes) ok = false;
+  };
+
+  string_hash_table_t<int, counting_options> by_histogram;
+  by_histogram.reserve(length_counts, std::size(length_counts));
+  for (const std::string &key : keys) by_histogram[key] = 1;
+  check("reserve by histogram", by_histogram.stats(), by_histogram.stats().counters.rehashes);
+
+  // Every 16th key is a sample: reservation is rounded up to powers of 2, it absorbs the
+  // sampling error
+  std::vector<std::string_view> sample;
+  for (size_t i = 0; i < std::size(keys); i += 16) sample.push_back(keys[i]);
+  string_hash_table_t<int, counting_options> by_sample;
+  by_sample.reserve(std::size(keys), std::data(sample), std::size(sample));
+  for (const std::string &key : keys) by_sample[key] = 1;
+  check("reserve by sample", by_sample.stats(), by_sample.stats().counters.rehashes);
+
+  // The class mix observed by the first fill drives reserve() of the next one
+  string_hash_table_t<int, adaptive_counting_options> adaptive;
+  std::shuffle(std::begin(keys), std::end(keys), rnd);
+  for (const std::string &key : keys) adaptive[key] = 1;
+  uint64_t growth_rehashes = adaptive.stats().counters.rehashes;
+  adaptive.clear();
+  adaptive.reserve(std::size(keys));
+  for (const std::string &key : keys) adaptive[key] = 1;
+  check("adaptive reserve", adaptive.stats(),
+        adaptive.stats().counters.rehashes - growth_rehashes);
+
+  // Growth along: submaps of the major class's mix grow together with it
+  string_hash_table_t<int, counting_options> plain;
+  for (const std::string &key : keys) plain[key] = 1;
+  std::cerr << "rehashes while growing: plain = " << plain.stats().counters.rehashes
+            << ", adaptive = " << growth_rehashes << std::endl;
+  return ok;
+}
+
+bool exec_incremental();
+bool exec_incremental() {
+  // Random insertions, erasures and lookups of a migrating submap, checked against a reference
+  detail::flat_map_t<detail::string_key8, uint64_t, detail::hasher_t, true> map;
+  std::unordered_map<uint64_t, uint64_t> reference;
+  auto same_elements = [&map, &reference]() {
+    // Iteration covers both arrays while migrating
+    uint64_t sum = 0;
+    for (const auto &[key, value] : map) sum += key ^ value;
+    uint64_t reference_sum = 0;
+    for (const auto &[key, value] : reference) reference_sum += key ^ value;
+    return map.size() == std::size(reference) && sum == reference_sum;
+  };
+  std::mt19937_64 rnd(1);
+  size_t migrating_ops = 0;
+  size_t migrating_checks = 0;
+  bool ok = true;
+  for (uint64_t i = 0; i < 200000 && ok; ++i) {
+    uint64_t key = rnd() % 100000 + 1;  // 0 is the empty key, it's not of this class
+    if (map.migrating()) {
+      ++migrating_ops;
+      if (i % 64 == 0) {
+        // Elements are in either array, migrated slots are not tombstones of the current ones
+        auto stats = map.stats();
+        ok = same_elements() && stats.size == std::size(reference) && stats.old_size <= stats.size
+          && stats.old_capacity && stats.load_factor <= 7.0 / 8
+          && stats.size - stats.old_size + stats.tombstones <= stats.capacity - stats.capacity / 8;
+        ++migrating_checks;
+      }
+    }
+    switch (rnd() % 4) {
+      case 0:
+        ok = ok && map.erase(key) == bool(reference.erase(key));
+        break;
+      case 1: {
+        auto *slot = map.find(key);
+        auto it = reference.find(key);
+        ok = ok && (slot ? it != std::end(reference) && slot->second == it->second
+                         : it == std::end(reference));
+        break;
+      }
+      default:
+        ok = ok && map.try_emplace(key, i).second == reference.try_emplace(key, i).second;
+    }
+  }
+  ok = ok && same_elements();
+  std::cerr << "incremental rehashing: " << (ok ? "ok" : "FAILED")
+            << ", operations while migrating = " << migrating_ops << ", iterations checked = "
+            << migrating_checks << std::endl;
+  return ok;
+}
+
+bool exec_filter();
+bool exec_filter() {
+  // Every path into a filtered map adds the key's hash to the filter, so the key is found then
+  using filtered_map_t = detail::filtered_map_t<
+    detail::flat_map_t<detail::string_key8, uint64_t, detail::hasher_t, false>, detail::hasher_t,
+    true>;
+  filtered_map_t map;
+  std::unordered_map<uint64_t, uint64_t> reference;
+  std::mt19937_64 rnd(1);
+  bool ok = true;
+  for (uint64_t i = 0; i < 100000 && ok; ++i) {
+    uint64_t key = rnd() % 50000 + 1;
+    switch (rnd() % 4) {
+      case 0: ok = map.erase(key) == bool(reference.erase(key)); break;
+      case 1: {
+        auto [slot, inserted] = map.try_emplace(key, i);
+        ok = inserted == reference.try_emplace(key, i).second && map.find(key) == slot;
+        break;
+      }
+      default: {
+        auto *slot = map.find(key);
+        auto it = reference.find(key);
+        ok = slot ? it != std::end(reference) && slot->second == it->second
+                  : it == std::end(reference);
+      }
+    }
+  }
+  ok = ok && map.size() == std::size(reference);
+  detail::block_filter_stats_t stats = map.filter_stats();
+  std::cerr << "filtered map: " << (ok ? "ok" : "FAILED") << ", rejects = " << stats.rejects
+            << ", false positives = " << stats.false_positives << std::endl;
+  return ok;
+}
+
 int main(int /*argc*/, char */*argv*/[]) {
   try {
+    if (!exec_hash_quality()) return -1;
+    if (!exec_reserve()) return -1;
+    if (!exec_incremental()) return -1;
+    if (!exec_filter()) return -1;
     exec_basic();
+    if (!exec_stats()) return -1;
+    if (!exec_concurrent()) return -1;
+    if (!exec_rcu()) return -1;
+    if (!exec_snapshot()) return -1;
+    if (!exec_spilling()) return -1;
+    if (!exec_join()) return -1;
+    if (!exec_set()) return -1;
+    if (!exec_dictionary()) return -1;
+    if (!exec_cache()) return -1;
+    if (!exec_frozen()) return -1;
     //exec_ref();
     //exec_test();
     return 0;
@@ -0,0 +1,447 @@
+/// \file
+/// \brief Snapshot files of string hash tables and read-only tables mapped from them
+
+#pragma once
+
+#include "string_hash_table.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include <emmintrin.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace detail {
+
+// Snapshot file: header, then every size class' control bytes and slots, then the chars of long
+// keys (heap). Sections are 64-byte aligned and referred to by file offsets, so the file is
+// position independent. The layout does not depend on the process that writes it: groups are
+// 16 control bytes wide (SSE2) and long keys are hashed by crc3 (the same with or without
+// SSE4.2), not by the process' hash kernel.
+constexpr char snapshot_magic[8] = {'S', 'H', 'T', 'S', 'N', 'A', 'P', 0};
+constexpr uint32_t snapshot_version = 1;
+constexpr size_t snapshot_group_width = 16;
+constexpr size_t snapshot_alignment = 64;
+
+struct snapshot_section_t {
+  uint64_t offset;
+  uint64_t bytes;
+  uint32_t checksum;  // snapshot_checksum() of the bytes
+  uint32_t reserved;
+};
+
+struct snapshot_class_t {
+  uint64_t capacity;  // slots: power of 2 not less than the group width
+  uint64_t size;
+  snapshot_section_t ctrl;
+  snapshot_section_t slots;
+};
+
+struct snapshot_header_t {
+  char magic[8];
+  uint32_t version;
+  uint32_t group_width;
+  uint64_t value_size;
+  uint64_t value_align;
+  uint64_t size;
+  snapshot_class_t classes[5];  // by key_type
+  snapshot_section_t heap;
+  uint32_t reserved;
+  uint32_t checksum;  // snapshot_checksum() of the preceding bytes
+};
+
+// Long key of a snapshot: chars are heap[offset, offset + size).
+struct snapshot_long_key_t {
+  string_key_head head;  // head.hash is snapshot_long_hash()
+  uint64_t offset;
+};
+
+template <typename K, typename T>
+struct snapshot_slot_t {
+  K key;
+  T value;
+};
+
+inline uint32_t snapshot_checksum(const char *data, size_t size) {
+  uint32_t res = uint32_t(-1);
+  for (; size >= 8; data += 8, size -= 8) res = crc32_u64(res, load_u64(data));
+  uint64_t tail = 0;
+  memcpy(&tail, data, size);
+  return crc32_u64(res, tail);
+}
+
+inline uint32_t snapshot_long_hash(std::string_view sv) {
+  static const auto fn = hash_kernel_supported(hash_kernel_crc3) ? hash_crc3_sse42
+                                                                 : hash_crc3_soft;
+  return fn(std::data(sv), std::size(sv));
+}
+
+// Group of control bytes probed at once. Note: control bytes of the writer are not aligned.
+struct snapshot_group_t {
+  explicit ALWAYS_INLINE snapshot_group_t(const ctrl_t *pos)
+    : ctrl(_mm_loadu_si128(reinterpret_cast<const __m128i *>(pos))) {}
+
+  uint32_t ALWAYS_INLINE match(ctrl_t h2) const {
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, _mm_set1_epi8(h2)));
+  }
+  uint32_t ALWAYS_INLINE match_empty() const { return match(ctrl_empty); }
+
+  __m128i ctrl;
+};
+static_assert(snapshot_group_width == sizeof(__m128i));
+
+} // detail::
+
+/// Read-only hash table with string keys mapped from a snapshot file, see save(). Lookups probe
+/// the mapping itself, nothing is deserialized: opening costs a few system calls, pages are read
+/// on demand and shared by all the processes mapping the file.
+template <typename T>
+class mapped_string_hash_table_t {
+  static_assert(std::is_trivially_copyable_v<T>, "Mapped values are stored as bytes");
+
+public:
+  using mapped_type = T;
+
+  /// Writes the table into a snapshot file. The file is written aside, synced and renamed, so
+  /// the processes mapping the previous one are not affected and a crash leaves either file.
+  template <typename Options>
+  static void save(const string_hash_table_t<T, Options> &table, const std::string &path);
+
+  /// Maps the snapshot file. The header is always checked, the sections are checksummed if
+  /// verify (it reads the whole file). A moved-from table is empty.
+  explicit mapped_string_hash_table_t(const std::string &path, bool verify = false);
+  mapped_string_hash_table_t(const mapped_string_hash_table_t &) = delete;
+  mapped_string_hash_table_t(mapped_string_hash_table_t &&other) noexcept
+    : m_data(std::exchange(other.m_data, nullptr)), m_bytes(other.m_bytes) {}
+  mapped_string_hash_table_t &operator=(const mapped_string_hash_table_t &) = delete;
+  mapped_string_hash_table_t &operator=(mapped_string_hash_table_t &&other) noexcept {
+    std::swap(m_data, other.m_data);
+    std::swap(m_bytes, other.m_bytes);
+    return *this;
+  }
+  ~mapped_string_hash_table_t() {
+    if (m_data) munmap(const_cast<char *>(m_data), m_bytes);
+  }
+
+  bool empty() const noexcept { return !size(); }
+  size_t size() const noexcept { return m_data ? header().size : 0; }
+
+  const mapped_type *find(std::string_view key) const;
+  bool contains(std::string_view key) const { return find(key); }
+
+  /// Calls f(std::string_view, const mapped_type &) for every element, both refer to the mapping.
+  template <typename F>
+  void for_each(F &&f) const;
+
+private:
+  using long_key_t = detail::snapshot_long_key_t;
+  template <typename K>
+  using slot_t = detail::snapshot_slot_t<K, T>;
+  static_assert(alignof(slot_t<long_key_t>) <= detail::snapshot_alignment);
+
+  const char *m_data = nullptr;
+  size_t m_bytes = 0;
+
+  const detail::snapshot_header_t &header() const {
+    return *reinterpret_cast<const detail::snapshot_header_t *>(m_data);
+  }
+  template <typename K>
+  const slot_t<K> *slots(detail::key_type type) const {
+    return reinterpret_cast<const slot_t<K> *>(m_data + header().classes[type].slots.offset);
+  }
+  const detail::ctrl_t *ctrl(detail::key_type type) const {
+    return reinterpret_cast<const detail::ctrl_t *>(m_data + header().classes[type].ctrl.offset);
+  }
+  std::string_view long_key_view(const long_key_t &key) const {
+    return {m_data + header().heap.offset + key.offset, key.head.size};
+  }
+  template <typename K>
+  static size_t slot_hash(const K &key) {
+    if constexpr (std::is_same_v<K, long_key_t>) return key.head.hash;
+    else return detail::hasher_t()(key);
+  }
+  // Returns the slot of the class satisfying eq(key) or nullptr.
+  template <typename K, typename Eq>
+  const slot_t<K> *probe(detail::key_type type, size_t hash, Eq &&eq) const;
+  template <typename K, typename F>
+  void for_each_slot(detail::key_type type, F &&f) const;
+  static void write_section(FILE *file, const void *data, size_t bytes,
+                            detail::snapshot_section_t &section);
+  template <typename K>
+  static void write_class(FILE *file, const std::vector<std::pair<K, T>> &elems,
+                          detail::snapshot_class_t &cls);
+  void check(bool verify) const;
+};
+
+template <typename T>
+template <typename Options>
+void mapped_string_hash_table_t<T>::save(const string_hash_table_t<T, Options> &table,
+                                         const std::string &path) {
+  std::vector<std::pair<detail::string_key0, T>> elems0;
+  std::vector<std::pair<detail::string_key8, T>> elems8;
+  std::vector<std::pair<detail::string_key16, T>> elems16;
+  std::vector<std::pair<detail::string_key24, T>> elems24;
+  std::vector<std::pair<long_key_t, T>> elems_str;
+  std::string heap;
+  table.for_each_hashed([&](std::string_view key, size_t, const T &value) {
+    switch (detail::map_size_to_key_type(std::size(key))) {
+      case detail::key_type0: elems0.emplace_back(detail::string_key0(), value); break;
+      case detail::key_type8: elems8.emplace_back(detail::to_string_key8(key), value); break;
+      case detail::key_type16: elems16.emplace_back(detail::to_string_key16(key), value); break;
+      case detail::key_type24: elems24.emplace_back(detail::to_string_key24(key), value); break;
+      case detail::key_type_str: {
+        size_t hash = detail::snapshot_long_hash(key);
+        elems_str.emplace_back(long_key_t{detail::to_string_key_head(key, hash), std::size(heap)},
+                               value);
+        heap += key;
+        break;
+      }
+      default: UNREACHABLE();
+    }
+  });
+
+  detail::snapshot_header_t header = {};
+  memcpy(header.magic, detail::snapshot_magic, sizeof(header.magic));
+  header.version = detail::snapshot_version;
+  header.group_width = detail::snapshot_group_width;
+  header.value_size = sizeof(T);
+  header.value_align = alignof(T);
+  header.size = table.size();
+
+  std::string tmp_path = path + ".tmp";
+  try {
+    std::unique_ptr<FILE, deleter_from_fn<fclose>> file(fopen(tmp_path.c_str(), "wb"));
+    if (!file) error("Cannot create %s", tmp_path.c_str());
+    detail::snapshot_section_t header_section;
+    write_section(file.get(), &header, sizeof(header), header_section);  // placeholder
+    write_class(file.get(), elems0, header.classes[detail::key_type0]);
+    write_class(file.get(), elems8, header.classes[detail::key_type8]);
+    write_class(file.get(), elems16, header.classes[detail::key_type16]);
+    write_class(file.get(), elems24, header.classes[detail::key_type24]);
+    write_class(file.get(), elems_str, header.classes[detail::key_type_str]);
+    write_section(file.get(), std::data(heap), std::size(heap), header.heap);
+    header.checksum = detail::snapshot_checksum(reinterpret_cast<const char *>(&header),
+                                                offsetof(detail::snapshot_header_t, checksum));
+    if (fseek(file.get(), 0, SEEK_SET) || fwrite(&header, sizeof(header), 1, file.get()) != 1
+        || fflush(file.get()) || fsync(fileno(file.get())) || fclose(file.release())) {
+      error("Cannot write %s", tmp_path.c_str());
+    }
+    if (rename(tmp_path.c_str(), path.c_str())) error("Cannot rename %s", tmp_path.c_str());
+  } catch (...) {
+    remove(tmp_path.c_str());
+    throw;
+  }
+  // The rename is durable once the directory is synced
+  size_t slash = path.rfind('/');
+  std::string dir = slash == std::string::npos ? "." : slash ? path.substr(0, slash) : "/";
+  int fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+  if (fd < 0) error("Cannot open %s", dir.c_str());
+  int synced = fsync(fd);
+  close(fd);
+  if (synced) error("Cannot sync %s", dir.c_str());
+}
+
+template <typename T>
+void mapped_string_hash_table_t<T>::write_section(FILE *file, const void *data, size_t bytes,
+                                                  detail::snapshot_section_t &section) {
+  static const char padding[detail::snapshot_alignment] = {};
+  long pos = ftell(file);
+  size_t padding_size = pos < 0 ? 0 : -size_t(pos) % detail::snapshot_alignment;
+  if (pos < 0 || fwrite(padding, 1, padding_size, file) != padding_size
+      || fwrite(data, 1, bytes, file) != bytes) {
+    error("Cannot write snapshot section");
+  }
+  section = {pos + padding_size, bytes,
+             detail::snapshot_checksum(static_cast<const char *>(data), bytes), 0};
+}
+
+template <typename T>
+template <typename K>
+void mapped_string_hash_table_t<T>::write_class(FILE *file,
+                                                const std::vector<std::pair<K, T>> &elems,
+                                                detail::snapshot_class_t &cls) {
+  // The same probing as detail::flat_map_t: triangular over groups, load factor under 7/8.
+  size_t capacity = detail::snapshot_group_width;
+  while (capacity - capacity / 8 < std::size(elems)) capacity <<= 1;
+  std::vector<detail::ctrl_t> ctrl(capacity, detail::ctrl_empty);
+  // Zeroed, so free slots (and padding) do not put garbage into the file
+  std::unique_ptr<slot_t<K>[]> slots(new slot_t<K>[capacity]());
+  const size_t mask = capacity / detail::snapshot_group_width - 1;
+  for (const auto &[key, value] : elems) {
+    size_t hash = slot_hash(key);
+    size_t g = detail::hash_h1(hash) & mask;
+    for (size_t step = 1;; ++step) {
+      size_t first = g * detail::snapshot_group_width;
+      if (auto m = detail::snapshot_group_t(&ctrl[first]).match_empty()) {
+        size_t index = first + __builtin_ctz(m);
+        ctrl[index] = detail::hash_h2(hash);
+        memcpy(&slots[index].key, &key, sizeof(K));
+        memcpy(&slots[index].value, &value, sizeof(T));
+        break;
+      }
+      g = (g + step) & mask;
+    }
+  }
+  cls.capacity = capacity;
+  cls.size = std::size(elems);
+  write_section(file, std::data(ctrl), capacity, cls.ctrl);
+  write_section(file, slots.get(), capacity * sizeof(slot_t<K>), cls.slots);
+}
+
+template <typename T>
+mapped_string_hash_table_t<T>::mapped_string_hash_table_t(const std::string &path, bool verify) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) error("Cannot open %s", path.c_str());
+  struct stat st;
+  void *data = MAP_FAILED;
+  if (!fstat(fd, &st) && size_t(st.st_size) >= sizeof(detail::snapshot_header_t)) {
+    data = mmap(nullptr, size_t(st.st_size), PROT_READ, MAP_SHARED, fd, 0);
+  }
+  close(fd);  // the mapping stays
+  if (data == MAP_FAILED) error("Cannot map %s", path.c_str());
+  m_data = static_cast<const char *>(data);
+  m_bytes = size_t(st.st_size);
+  try {
+    check(verify);
+  } catch (...) {
+    munmap(data, m_bytes);
+    throw;
+  }
+}
+
+template <typename T>
+void mapped_string_hash_table_t<T>::check(bool verify) const {
+  const detail::snapshot_header_t &h = header();
+  if (memcmp(h.magic, detail::snapshot_magic, sizeof(h.magic))) error("Not a snapshot file");
+  if (h.version != detail::snapshot_version) error("Unsupported snapshot version %u", h.version);
+  if (h.checksum != detail::snapshot_checksum(m_data, offsetof(detail::snapshot_header_t,
+                                                                checksum))) {
+    error("Snapshot header checksum mismatch");
+  }
+  if (h.group_width != detail::snapshot_group_width || h.value_size != sizeof(T)
+      || h.value_align != alignof(T)) {
+    error("Snapshot layout mismatch");
+  }
+  auto check_section = [this, verify](const detail::snapshot_section_t &section) {
+    if (section.offset % detail::snapshot_alignment || section.offset > m_bytes
+        || section.bytes > m_bytes - section.offset) {
+      error("Snapshot section out of file");
+    }
+    if (verify && section.checksum != detail::snapshot_checksum(m_data + section.offset,
+                                                                section.bytes)) {
+      error("Snapshot section checksum mismatch");
+    }
+  };
+  const size_t slot_sizes[5] = {sizeof(slot_t<detail::string_key0>),
+                                sizeof(slot_t<detail::string_key8>),
+                                sizeof(slot_t<detail::string_key16>),
+                                sizeof(slot_t<detail::string_key24>), sizeof(slot_t<long_key_t>)};
+  size_t size = 0;
+  for (size_t i = 0; i < 5; ++i) {
+    const detail::snapshot_class_t &cls = h.classes[i];
+    if (cls.capacity < detail::snapshot_group_width || cls.capacity & (cls.capacity - 1)
+        || cls.ctrl.bytes != cls.capacity || cls.slots.bytes != cls.capacity * slot_sizes[i]
+        || cls.size > cls.capacity) {
+      error("Snapshot class %zu is malformed", i);
+    }
+    check_section(cls.ctrl);
+    check_section(cls.slots);
+    size += cls.size;
+  }
+  check_section(h.heap);
+  if (size != h.size) error("Snapshot size mismatch");
+  // Long keys are checked lazily: a key reaching out of the heap never matches.
+}
+
+template <typename T>
+template <typename K, typename Eq>
+auto mapped_string_hash_table_t<T>::probe(detail::key_type type, size_t hash, Eq &&eq) const
+  -> const slot_t<K> * {
+  const detail::ctrl_t *ctrl_bytes = ctrl(type);
+  const slot_t<K> *slot_array = slots<K>(type);
+  const detail::ctrl_t h2 = detail::hash_h2(hash);
+  const size_t mask = header().classes[type].capacity / detail::snapshot_group_width - 1;
+  size_t g = detail::hash_h1(hash) & mask;
+  for (size_t step = 1; step <= mask + 1; ++step) {  // bounded: the file may be full
+    size_t first = g * detail::snapshot_group_width;
+    detail::snapshot_group_t group(ctrl_bytes + first);
+    for (auto m = group.match(h2); m; m &= m - 1) {
+      const slot_t<K> &slot = slot_array[first + __builtin_ctz(m)];
+      if (LIKELY(eq(slot.key))) return &slot;
+    }
+    if (LIKELY(group.match_empty())) break;
+    g = (g + step) & mask;
+  }
+  return nullptr;
+}
+
+template <typename T>
+auto mapped_string_hash_table_t<T>::find(std::string_view key) const -> const mapped_type * {
+  if (UNLIKELY(!m_data)) return nullptr;  // moved from
+  auto find_short = [this](detail::key_type type, const auto &short_key) -> const mapped_type * {
+    using K = std::decay_t<decltype(short_key)>;
+    const slot_t<K> *slot = probe<K>(type, detail::hasher_t()(short_key), [&short_key](const K &k) {
+      return k == short_key;
+    });
+    return slot ? &slot->value : nullptr;
+  };
+  switch (detail::map_size_to_key_type(std::size(key))) {
+    case detail::key_type0: return find_short(detail::key_type0, detail::string_key0());
+    case detail::key_type8: return find_short(detail::key_type8, detail::to_string_key8(key));
+    case detail::key_type16: return find_short(detail::key_type16, detail::to_string_key16(key));
+    case detail::key_type24: return find_short(detail::key_type24, detail::to_string_key24(key));
+    case detail::key_type_str: {
+      size_t hash = detail::snapshot_long_hash(key);
+      detail::string_key_head head = detail::to_string_key_head(key, hash);
+      size_t heap_bytes = header().heap.bytes;
+      const slot_t<long_key_t> *slot = probe<long_key_t>(
+        detail::key_type_str, hash, [&](const long_key_t &k) {
+          return detail::equal_heads(k.head, head) && k.offset <= heap_bytes
+            && k.head.size <= heap_bytes - k.offset
+            && detail::equal_tails(head, std::data(long_key_view(k)), std::data(key));
+        });
+      return slot ? &slot->value : nullptr;
+    }
+    default: UNREACHABLE();
+  };
+}
+
+template <typename T>
+template <typename K, typename F>
+void mapped_string_hash_table_t<T>::for_each_slot(detail::key_type type, F &&f) const {
+  const detail::ctrl_t *ctrl_bytes = ctrl(type);
+  const slot_t<K> *slot_array = slots<K>(type);
+  for (size_t i = 0; i < header().classes[type].capacity; ++i) {
+    if (ctrl_bytes[i] >= 0) f(slot_array[i]);
+  }
+}
+
+template <typename T>
+template <typename F>
+void mapped_string_hash_table_t<T>::for_each(F &&f) const {
+  if (!m_data) return;  // moved from
+  auto each_short = [&f](const auto &slot) { f(detail::to_string_view(slot.key), slot.value); };
+  for_each_slot<detail::string_key0>(detail::key_type0, each_short);
+  for_each_slot<detail::string_key8>(detail::key_type8, each_short);
+  for_each_slot<detail::string_key16>(detail::key_type16, each_short);
+  for_each_slot<detail::string_key24>(detail::key_type24, each_short);
+  size_t heap_bytes = header().heap.bytes;
+  for_each_slot<long_key_t>(detail::key_type_str, [&](const slot_t<long_key_t> &slot) {
+    if (slot.key.offset <= heap_bytes && slot.key.head.size <= heap_bytes - slot.key.offset) {
+      f(long_key_view(slot.key), slot.value);
+    }
+  });
+}
+
+
+/* ==TRASH==
+*/
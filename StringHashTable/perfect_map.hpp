@@ -0,0 +1,206 @@
+/// \file
+/// \brief Immutable hash map over a minimal perfect hash of its keys
+
+#pragma once
+
+#include "utils.hpp"
+#include <algorithm>
+#include <cstdint>
+#include <iterator>
+#include <numeric>
+#include <utility>
+#include <vector>
+
+namespace detail {
+
+/// Immutable hash map built once from a fixed set of elements. Keys are placed by a minimal
+/// perfect hash (CHD, "compress, hash and displace"): hashes select buckets of about
+/// bucket_load keys, every bucket has a seed that displaces its keys to distinct slots. There are
+/// exactly as many slots as distinct hashes, and a lookup is a seed load, a slot load and a key
+/// compare. Keys are placed by their 32-bit Hash values (CRC32 based ones fit); a key whose hash
+/// equals the one of a placed key goes to a small overflow sorted by hash instead, and its bucket
+/// is flagged, so only a failed compare in a flagged bucket searches the overflow.
+template <typename K, typename T, typename Hash>
+class perfect_map_t {
+public:
+  using key_type = K;
+  using mapped_type = T;
+  using value_type = std::pair<K, T>;
+  using const_iterator = const value_type *;
+
+  static constexpr size_t bucket_load = 4;
+  static constexpr uint32_t max_seed = 1 << 24;  // seeds tried per bucket before giving up
+
+  perfect_map_t() = default;
+  /// Keys must be distinct, see duplicate().
+  explicit perfect_map_t(std::vector<value_type> elems);
+
+  bool empty() const noexcept { return m_slots.empty(); }
+  size_t size() const noexcept { return std::size(m_slots); }
+
+  const_iterator begin() const { return std::data(m_slots); }
+  const_iterator end() const { return std::data(m_slots) + std::size(m_slots); }
+
+  /// Element that satisfies eq(key) with the hash or nullptr.
+  template <typename Eq>
+  const value_type *find(size_t hash, Eq &&eq) const {
+    if (UNLIKELY(m_slots.empty())) return nullptr;
+    const uint32_t seed = m_seeds[bucket_of(hash)];
+    const value_type &slot = m_slots[slot_of(hash, seed & ~overflow_flag, m_slot_count)];
+    if (LIKELY(eq(slot.first))) return &slot;
+    return UNLIKELY(seed & overflow_flag) ? find_overflow(hash, eq) : nullptr;
+  }
+  template <typename L>
+  const value_type *find(const L &key) const {
+    return find(Hash()(key), [&key](const K &k) { return k == key; });
+  }
+
+  /// Elements with equal hashes, those are searched after the slot compare fails.
+  size_t overflow_size() const noexcept { return std::size(m_overflow_hashes); }
+
+  /// Seeds, slots and overflow hashes.
+  size_t memory_bytes() const noexcept {
+    return m_seeds.capacity() * sizeof(uint32_t) + m_slots.capacity() * sizeof(value_type)
+      + m_overflow_hashes.capacity() * sizeof(uint32_t);
+  }
+
+  /// Key of an element that satisfies eq(key, other key) with another element, or nullptr. Only
+  /// keys with equal hashes are compared. Note: it's O(n log n).
+  template <typename Eq>
+  static const K *duplicate(const std::vector<value_type> &elems, Eq &&eq);
+
+private:
+  static constexpr uint32_t overflow_flag = 1u << 31;  // in a seed, max_seed is below it
+
+  std::vector<uint32_t> m_seeds;  // by bucket
+  std::vector<value_type> m_slots;  // m_slot_count placed ones, then the overflow
+  std::vector<uint32_t> m_overflow_hashes;  // sorted, of m_slots[m_slot_count:]
+  size_t m_slot_count = 0;
+
+  // Both map 32 bits to a range by multiplication, no division
+  size_t bucket_of(size_t hash) const {
+    return size_t(uint64_t(uint32_t(hash)) * std::size(m_seeds) >> 32);
+  }
+  static size_t slot_of(size_t hash, uint32_t seed, size_t slot_count) {
+    uint64_t x = (uint64_t(uint32_t(hash)) | uint64_t(seed) << 32) * 0x9e3779b97f4a7c15;
+    x ^= x >> 29;
+    x *= 0xbf58476d1ce4e5b9;
+    return size_t((x >> 32) * slot_count >> 32);
+  }
+
+  template <typename Eq>
+  const value_type *find_overflow(size_t hash, Eq &&eq) const {
+    auto it = std::lower_bound(std::begin(m_overflow_hashes), std::end(m_overflow_hashes),
+                               uint32_t(hash));
+    for (; it != std::end(m_overflow_hashes) && *it == uint32_t(hash); ++it) {
+      const value_type &slot = m_slots[m_slot_count + (it - std::begin(m_overflow_hashes))];
+      if (eq(slot.first)) return &slot;
+    }
+    return nullptr;
+  }
+
+  // (hash, element index) sorted by hash
+  static std::vector<std::pair<uint32_t, size_t>> sorted_hashes(
+    const std::vector<value_type> &elems);
+};
+
+template <typename K, typename T, typename Hash>
+std::vector<std::pair<uint32_t, size_t>> perfect_map_t<K, T, Hash>::sorted_hashes(
+  const std::vector<value_type> &elems) {
+  std::vector<std::pair<uint32_t, size_t>> hashes(std::size(elems));
+  for (size_t i = 0; i < std::size(elems); ++i) {
+    hashes[i] = {uint32_t(Hash()(elems[i].first)), i};
+  }
+  std::sort(std::begin(hashes), std::end(hashes));
+  return hashes;
+}
+
+template <typename K, typename T, typename Hash>
+template <typename Eq>
+const K *perfect_map_t<K, T, Hash>::duplicate(const std::vector<value_type> &elems, Eq &&eq) {
+  const auto hashes = sorted_hashes(elems);
+  for (size_t first = 0, last = 0; first < std::size(hashes); first = last) {
+    while (++last < std::size(hashes) && hashes[last].first == hashes[first].first) {
+      for (size_t i = first; i < last; ++i) {
+        const K &key = elems[hashes[last].second].first;
+        if (eq(elems[hashes[i].second].first, key)) return &key;
+      }
+    }
+  }
+  return nullptr;
+}
+
+template <typename K, typename T, typename Hash>
+perfect_map_t<K, T, Hash>::perfect_map_t(std::vector<value_type> elems) {
+  const size_t n = std::size(elems);
+  if (!n) return;
+  // The first element of every hash is placed, the others are the overflow
+  const auto hashes = sorted_hashes(elems);
+  std::vector<size_t> overflow;
+  for (size_t i = 1; i < n; ++i) {
+    if (hashes[i].first == hashes[i - 1].first) overflow.push_back(i);
+  }
+  m_slot_count = n - std::size(overflow);
+  m_seeds.resize((m_slot_count + bucket_load - 1) / bucket_load);
+  m_slots.reserve(n);
+  // Placed elements by bucket, buckets by size descending: large buckets are placed while most of
+  // the slots are free
+  std::vector<size_t> bucket_starts(std::size(m_seeds) + 1);
+  std::vector<size_t> order(m_slot_count);  // indexes into hashes
+  for (size_t i = 0; i < n; ++i) {
+    if (i && hashes[i].first == hashes[i - 1].first) continue;
+    ++bucket_starts[bucket_of(hashes[i].first) + 1];
+  }
+  std::partial_sum(std::begin(bucket_starts), std::end(bucket_starts), std::begin(bucket_starts));
+  {
+    std::vector<size_t> pos(std::begin(bucket_starts), std::prev(std::end(bucket_starts)));
+    for (size_t i = 0; i < n; ++i) {
+      if (i && hashes[i].first == hashes[i - 1].first) continue;
+      order[pos[bucket_of(hashes[i].first)]++] = i;
+    }
+  }
+  std::vector<size_t> buckets(std::size(m_seeds));
+  std::iota(std::begin(buckets), std::end(buckets), 0);
+  std::stable_sort(std::begin(buckets), std::end(buckets), [&bucket_starts](size_t a, size_t b) {
+    return bucket_starts[a + 1] - bucket_starts[a] > bucket_starts[b + 1] - bucket_starts[b];
+  });
+
+  std::vector<size_t> placed(m_slot_count, size_t(-1));  // element index by slot
+  std::vector<size_t> slots;
+  for (size_t b : buckets) {
+    if (bucket_starts[b] == bucket_starts[b + 1]) break;  // the rest is empty too
+    uint32_t seed = 0;
+    for (;; ++seed) {
+      if (seed == max_seed) error("Perfect hash map: no seed for a bucket of %zu keys",
+                                  bucket_starts[b + 1] - bucket_starts[b]);
+      slots.clear();
+      bool fits = true;
+      for (size_t j = bucket_starts[b]; fits && j < bucket_starts[b + 1]; ++j) {
+        size_t slot = slot_of(hashes[order[j]].first, seed, m_slot_count);
+        fits = placed[slot] == size_t(-1)
+          && std::find(std::begin(slots), std::end(slots), slot) == std::end(slots);
+        slots.push_back(slot);
+      }
+      if (fits) break;
+    }
+    m_seeds[b] = seed;
+    for (size_t j = bucket_starts[b]; j < bucket_starts[b + 1]; ++j) {
+      placed[slots[j - bucket_starts[b]]] = hashes[order[j]].second;
+    }
+  }
+  for (size_t slot = 0; slot < m_slot_count; ++slot) {
+    m_slots.push_back(std::move(elems[placed[slot]]));
+  }
+  m_overflow_hashes.reserve(std::size(overflow));
+  for (size_t i : overflow) {
+    m_seeds[bucket_of(hashes[i].first)] |= overflow_flag;
+    m_overflow_hashes.push_back(hashes[i].first);
+    m_slots.push_back(std::move(elems[hashes[i].second]));
+  }
+}
+
+} // detail::
+
+
+/* ==TRASH==
+*/
@@ -0,0 +1,185 @@
+/// \file
+/// \brief Read-mostly string hash table with snapshot reads (RCU)
+
+#pragma once
+
+#include "string_hash_table.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+/// Read-mostly hash table with string keys. Readers look up immutable snapshots: reading is a
+/// plain load of the current snapshot pointer, no locks and no atomic writes. Writers apply
+/// updates to a copy and publish it (read-copy-update), writers are serialized by a mutex.
+/// Replaced snapshots are reclaimed by quiescent-state based reclamation: every reader thread
+/// has a reader_t and calls its quiescent() between lookups (e.g. per request), stating that it
+/// holds no snapshot references. A snapshot is freed once all the readers have passed a
+/// quiescent state after its replacement.
+template <typename T, typename Options = string_hash_table_options>
+class rcu_string_hash_table_t {
+  static_assert(!Options::counters, "Counters of shared snapshots are not thread-safe");
+
+public:
+  using key_type = string_hash_key_t;
+  using mapped_type = T;
+  using table_type = string_hash_table_t<T, Options>;
+
+  class reader_t;
+
+  explicit rcu_string_hash_table_t(table_type &&table = table_type());
+  rcu_string_hash_table_t(const rcu_string_hash_table_t &) = delete;
+  rcu_string_hash_table_t &operator=(const rcu_string_hash_table_t &) = delete;
+  ~rcu_string_hash_table_t() = default;  // no reader may be left
+
+  /// Registers the calling reader thread. The reader must not outlive the table.
+  reader_t make_reader();
+
+  /// Applies f(table_type &) to a copy of the current snapshot and publishes the copy. So f may
+  /// batch any number of try_emplace(), erase() etc., readers see all of them or none.
+  template <typename F>
+  void update(F &&f);
+  /// Publishes a table built elsewhere.
+  void publish(table_type &&table);
+  /// Frees the replaced snapshots no reader may still hold. It's done by update() and publish()
+  /// as well.
+  void reclaim();
+  /// Replaced snapshots not freed yet (e.g. while some reader does not reach a quiescent state).
+  size_t retired_count() const;
+
+private:
+  struct alignas(64) reader_slot_t {  // own cache line, written by its reader only
+    std::atomic<uint64_t> epoch{offline};
+    bool used = false;  // under m_readers_mutex
+  };
+  static constexpr uint64_t offline = uint64_t(-1);
+
+  std::atomic<const table_type *> m_current;
+  std::unique_ptr<table_type> m_current_owner;
+  std::atomic<uint64_t> m_epoch{1};
+  // Replaced snapshots along with epochs of their replacement
+  std::vector<std::pair<uint64_t, std::unique_ptr<table_type>>> m_retired;
+  mutable std::mutex m_writer_mutex;  // m_current_owner, m_retired
+  std::vector<std::unique_ptr<reader_slot_t>> m_readers;
+  mutable std::mutex m_readers_mutex;  // m_readers
+
+  void publish_locked(std::unique_ptr<table_type> &&table);
+  void reclaim_locked();
+};
+
+/// Reader of rcu_string_hash_table_t, it's used by a single thread.
+template <typename T, typename Options>
+class rcu_string_hash_table_t<T, Options>::reader_t {
+public:
+  reader_t(reader_t &&other) noexcept
+    : m_owner(std::exchange(other.m_owner, nullptr)), m_slot(other.m_slot) {}
+  reader_t &operator=(reader_t &&) = delete;
+  ~reader_t() {
+    if (!m_owner) return;
+    m_slot->epoch.store(offline, std::memory_order_release);
+    std::lock_guard<std::mutex> lock(m_owner->m_readers_mutex);
+    m_slot->used = false;
+  }
+
+  /// The current snapshot. The reference is valid till the next quiescent().
+  const table_type &snapshot() const {
+    return *m_owner->m_current.load(std::memory_order_acquire);
+  }
+  const mapped_type *find(std::string_view key) const { return snapshot().find(key); }
+  bool contains(std::string_view key) const { return snapshot().contains(key); }
+
+  /// States that the snapshots got before are not referenced any more. Note: it's a plain store
+  /// to the reader's own cache line.
+  void quiescent() {
+    m_slot->epoch.store(m_owner->m_epoch.load(std::memory_order_acquire),
+                        std::memory_order_release);
+  }
+
+private:
+  friend class rcu_string_hash_table_t;
+  reader_t(rcu_string_hash_table_t *owner, reader_slot_t *slot) : m_owner(owner), m_slot(slot) {}
+
+  rcu_string_hash_table_t *m_owner;
+  reader_slot_t *m_slot;
+};
+
+template <typename T, typename Options>
+rcu_string_hash_table_t<T, Options>::rcu_string_hash_table_t(table_type &&table)
+  : m_current_owner(std::make_unique<table_type>(std::move(table))) {
+  m_current.store(m_current_owner.get(), std::memory_order_release);
+}
+
+template <typename T, typename Options>
+typename rcu_string_hash_table_t<T, Options>::reader_t
+rcu_string_hash_table_t<T, Options>::make_reader() {
+  std::lock_guard<std::mutex> lock(m_readers_mutex);
+  auto it = std::find_if(std::begin(m_readers), std::end(m_readers),
+                         [](const auto &slot) { return !slot->used; });
+  if (it == std::end(m_readers)) {
+    m_readers.push_back(std::make_unique<reader_slot_t>());
+    it = std::end(m_readers) - 1;
+  }
+  reader_slot_t *slot = it->get();
+  slot->used = true;
+  slot->epoch.store(m_epoch.load(std::memory_order_acquire), std::memory_order_release);
+  return reader_t(this, slot);
+}
+
+template <typename T, typename Options>
+template <typename F>
+void rcu_string_hash_table_t<T, Options>::update(F &&f) {
+  std::lock_guard<std::mutex> lock(m_writer_mutex);
+  auto table = std::make_unique<table_type>(*m_current_owner);
+  f(*table);
+  publish_locked(std::move(table));
+}
+
+template <typename T, typename Options>
+void rcu_string_hash_table_t<T, Options>::publish(table_type &&table) {
+  std::lock_guard<std::mutex> lock(m_writer_mutex);
+  publish_locked(std::make_unique<table_type>(std::move(table)));
+}
+
+template <typename T, typename Options>
+void rcu_string_hash_table_t<T, Options>::publish_locked(std::unique_ptr<table_type> &&table) {
+  m_current.store(table.get(), std::memory_order_release);
+  // Readers stating the new epoch have got the new snapshot
+  uint64_t epoch = m_epoch.fetch_add(1) + 1;
+  m_retired.emplace_back(epoch, std::exchange(m_current_owner, std::move(table)));
+  reclaim_locked();
+}
+
+template <typename T, typename Options>
+void rcu_string_hash_table_t<T, Options>::reclaim() {
+  std::lock_guard<std::mutex> lock(m_writer_mutex);
+  reclaim_locked();
+}
+
+template <typename T, typename Options>
+void rcu_string_hash_table_t<T, Options>::reclaim_locked() {
+  uint64_t min_epoch = offline;
+  {
+    std::lock_guard<std::mutex> lock(m_readers_mutex);
+    for (const auto &slot : m_readers) {
+      min_epoch = std::min(min_epoch, slot->epoch.load(std::memory_order_acquire));
+    }
+  }
+  m_retired.erase(std::remove_if(std::begin(m_retired), std::end(m_retired),
+                                 [min_epoch](const auto &retired) {
+                                   return retired.first <= min_epoch;
+                                 }),
+                  std::end(m_retired));
+}
+
+template <typename T, typename Options>
+size_t rcu_string_hash_table_t<T, Options>::retired_count() const {
+  std::lock_guard<std::mutex> lock(m_writer_mutex);
+  return std::size(m_retired);
+}
+
+
+/* ==TRASH==
+*/
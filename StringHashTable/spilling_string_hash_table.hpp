@@ -0,0 +1,212 @@
+/// \file
+/// \brief Hash aggregation with a memory budget, spilling to disk
+
+#pragma once
+
+#include "string_hash_table.hpp"
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include <unistd.h>
+
+/// Hash aggregation (see string_hash_table_t::upsert()) under a memory budget. The elements are
+/// aggregated in a string_hash_table_t while its memory_bytes() fits the budget. Once it does
+/// not, all of them are spilled into run files partitioned by hash bits and the table starts
+/// over. finish() aggregates the partitions one at a time (grace hash join style), a partition
+/// exceeding the budget in its turn is partitioned further by the next hash bits. The elements
+/// still in the table are not spilled: they are folded into their partitions as those are read.
+/// So memory use stays about the budget (twice the budget in finish(), plus a growth step of a
+/// submap) whatever the number of distinct keys is, at the cost of writing and reading spilled
+/// elements.
+/// Run files are unlinked temporary files in temp_dir, they vanish with the table or the process.
+template <typename T, typename Combine, typename Options = arena_string_hash_table_options>
+class spilling_string_hash_table_t {
+  static_assert(std::is_trivially_copyable_v<T>, "Spilled values are written as bytes");
+
+public:
+  using mapped_type = T;
+  using table_type = string_hash_table_t<T, Options>;
+
+  static constexpr int partition_bits = 4;
+  static constexpr size_t partition_count = size_t(1) << partition_bits;
+
+  /// combine(mapped_type &, const mapped_type &) folds a value into an aggregated one.
+  explicit spilling_string_hash_table_t(size_t memory_budget, Combine combine = Combine(),
+                                        std::string temp_dir = ".")
+    : m_budget(memory_budget), m_combine(std::move(combine)), m_temp_dir(std::move(temp_dir)) {}
+
+  void upsert(std::string_view key, const mapped_type &value) {
+    add(m_table, m_runs, 0, key, value);
+  }
+  /// upsert(keys[i], values[i]) for every i, the budget is checked every block of keys.
+  void accumulate(const std::string_view *keys, const mapped_type *values, size_t count);
+
+  /// Spills happened, both of the input and of partitions in finish().
+  size_t spill_count() const noexcept { return m_spill_count; }
+  /// Bytes written into run files.
+  size_t spilled_bytes() const noexcept { return m_spilled_bytes; }
+
+  /// Calls f(std::string_view, const mapped_type &) for every aggregated key once, partition
+  /// after partition. The table is empty afterwards.
+  template <typename F>
+  void finish(F &&f);
+
+private:
+  struct run_t {
+    std::unique_ptr<FILE, deleter_from_fn<fclose>> file;
+    size_t bytes = 0;
+  };
+  using runs_t = std::vector<run_t>;  // by partition, empty until the first spill
+
+  // Partitions of a level are selected by the next partition_bits of 32-bit hashes, the last
+  // level is aggregated in memory whatever it takes.
+  static constexpr int max_level = 32 / partition_bits - 1;
+  static constexpr size_t block_size = 1024;
+  // Smaller tables are not spilled, even if over the budget (e.g. an arena page exceeds it).
+  // Otherwise a tiny budget would spill and repartition about every element.
+  static constexpr size_t min_spill_size = 1024;
+
+  size_t m_budget;
+  Combine m_combine;
+  std::string m_temp_dir;
+  table_type m_table;
+  runs_t m_runs;
+  size_t m_spill_count = 0;
+  size_t m_spilled_bytes = 0;
+
+  static size_t partition(size_t hash, int level) {
+    return uint32_t(uint32_t(hash) << (level * partition_bits)) >> (32 - partition_bits);
+  }
+  void add(table_type &table, runs_t &runs, int level, std::string_view key,
+           const mapped_type &value) {
+    if (table.upsert(key, value, m_combine).second) check_budget(table, runs, level);
+  }
+  void check_budget(table_type &table, runs_t &runs, int level) {
+    if (UNLIKELY(table.memory_bytes() > m_budget) && table.size() >= min_spill_size
+        && level < max_level) {
+      spill(table, runs, level);
+    }
+  }
+  void spill(table_type &table, runs_t &runs, int level);
+  FILE *make_run_file() const;
+  // resident: elements in memory to fold into the partitions along with the runs
+  template <typename F>
+  void aggregate(runs_t &runs, int level, F &f, const table_type *resident = nullptr);
+};
+
+template <typename T, typename Combine, typename Options>
+void spilling_string_hash_table_t<T, Combine, Options>::accumulate(const std::string_view *keys,
+                                                                   const mapped_type *values,
+                                                                   size_t count) {
+  for (size_t begin = 0; begin < count; begin += block_size) {
+    size_t n = std::min(block_size, count - begin);
+    m_table.accumulate(keys + begin, values + begin, n, m_combine);
+    check_budget(m_table, m_runs, 0);
+  }
+}
+
+template <typename T, typename Combine, typename Options>
+FILE *spilling_string_hash_table_t<T, Combine, Options>::make_run_file() const {
+  std::string path = m_temp_dir + "/string_hash_table_run.XXXXXX";
+  int fd = mkstemp(std::data(path));
+  if (fd < 0) error("Cannot create a run file in %s", m_temp_dir.c_str());
+  unlink(path.c_str());  // the file lives while it's open
+  FILE *file = fdopen(fd, "w+b");
+  if (!file) {
+    close(fd);
+    error("Cannot open a run file in %s", m_temp_dir.c_str());
+  }
+  return file;
+}
+
+template <typename T, typename Combine, typename Options>
+void spilling_string_hash_table_t<T, Combine, Options>::spill(table_type &table, runs_t &runs,
+                                                              int level) {
+  if (runs.empty()) {
+    runs.resize(partition_count);
+    for (run_t &run : runs) run.file.reset(make_run_file());
+  }
+  // Record: uint32_t key size, key chars, value bytes
+  table.for_each_hashed([&](std::string_view key, size_t hash, const mapped_type &value) {
+    run_t &run = runs[partition(hash, level)];
+    uint32_t size = uint32_t(std::size(key));
+    if (fwrite(&size, sizeof(size), 1, run.file.get()) != 1
+        || fwrite(std::data(key), 1, size, run.file.get()) != size
+        || fwrite(&value, sizeof(value), 1, run.file.get()) != 1) {
+      error("Cannot write a run file in %s", m_temp_dir.c_str());
+    }
+    run.bytes += sizeof(size) + size + sizeof(value);
+    m_spilled_bytes += sizeof(size) + size + sizeof(value);
+  });
+  ++m_spill_count;
+  table = table_type();  // releases the memory, clear() keeps submaps' capacity
+}
+
+template <typename T, typename Combine, typename Options>
+template <typename F>
+void spilling_string_hash_table_t<T, Combine, Options>::finish(F &&f) {
+  if (m_runs.empty()) {
+    m_table.for_each_hashed([&f](std::string_view key, size_t, const mapped_type &value) {
+      f(key, value);
+    });
+  } else {
+    runs_t runs = std::move(m_runs);
+    aggregate(runs, 0, f, &m_table);
+  }
+  m_table = table_type();
+  m_runs.clear();
+}
+
+template <typename T, typename Combine, typename Options>
+template <typename F>
+void spilling_string_hash_table_t<T, Combine, Options>::aggregate(runs_t &runs, int level, F &f,
+                                                                  const table_type *resident) {
+  std::string key;
+  for (size_t part = 0; part < std::size(runs); ++part) {
+    run_t &run = runs[part];
+    if (!run.bytes && !resident) continue;
+    table_type table;
+    runs_t sub_runs;  // of the next level, if the partition exceeds the budget
+    if (resident) {
+      resident->for_each_hashed([&](std::string_view key, size_t hash, const mapped_type &value) {
+        if (partition(hash, level) == part) add(table, sub_runs, level + 1, key, value);
+      });
+    }
+    FILE *file = run.file.get();
+    if (run.bytes && (fflush(file) || fseek(file, 0, SEEK_SET))) {
+      error("Cannot read a run file in %s", m_temp_dir.c_str());
+    }
+    for (size_t pos = 0; pos < run.bytes;) {
+      uint32_t size;
+      mapped_type value;
+      if (fread(&size, sizeof(size), 1, file) != 1) error("Truncated run file");
+      key.resize(size);
+      if (fread(std::data(key), 1, size, file) != size
+          || fread(&value, sizeof(value), 1, file) != 1) {
+        error("Truncated run file");
+      }
+      pos += sizeof(size) + size + sizeof(value);
+      add(table, sub_runs, level + 1, key, value);
+    }
+    run.file.reset();  // the partition is consumed, its disk space is released
+    if (sub_runs.empty()) {
+      table.for_each_hashed([&f](std::string_view key, size_t, const mapped_type &value) {
+        f(key, value);
+      });
+    } else {
+      spill(table, sub_runs, level + 1);
+      aggregate(sub_runs, level + 1, f);
+    }
+  }
+}
+
+
+/* ==TRASH==
+*/
@@ -0,0 +1,135 @@
+/// \file
+/// \brief String dictionary: interning of strings as dense ids
+
+#pragma once
+
+#include "string_hash_table.hpp"
+#include <cstdint>
+#include <string_view>
+#include <tuple>
+#include <type_traits>
+#include <vector>
+
+/// Dictionary encoding of strings: intern() maps a string to a dense id (0, 1, 2... in order of
+/// first occurrence), lookup_id() maps the id back in O(1). Ids are stable, strings are never
+/// removed but by clear().
+/// The strings are keys of a string_hash_table_t mapping them to ids, so short strings are
+/// inline in their size class and interning is a single probe. The reverse mapping is an array
+/// of views into the table's arena: chars of long strings are there anyway (see
+/// Options::arena_keys), short ones are copied there once on insertion, as inline keys move with
+/// their slots. So views of ids stay valid while strings are interned, at the cost of a second
+/// copy of short (up to 24 chars) strings.
+template <typename Options = arena_string_hash_table_options>
+class string_dictionary_t {
+  static_assert(Options::arena_keys, "Views of long keys refer to the arena");
+
+public:
+  using id_type = uint32_t;
+  using table_type = string_hash_table_t<id_type, Options>;
+
+  static constexpr id_type no_id = id_type(-1);
+
+  string_dictionary_t() = default;
+  // Views refer to the arena, which is not copied
+  string_dictionary_t(const string_dictionary_t &) = delete;
+  string_dictionary_t(string_dictionary_t &&) = default;
+  string_dictionary_t &operator=(const string_dictionary_t &) = delete;
+  string_dictionary_t &operator=(string_dictionary_t &&) = default;
+
+  bool empty() const noexcept { return m_strings.empty(); }
+  size_t size() const noexcept { return std::size(m_strings); }
+  void clear() noexcept {
+    m_table.clear();
+    m_strings.clear();
+  }
+  void reserve(size_t elem_count) {
+    m_table.reserve(elem_count);
+    m_strings.reserve(elem_count);
+  }
+  /// Table, arena and the reverse mapping in O(1).
+  size_t memory_bytes() const noexcept {
+    return m_table.memory_bytes() + m_strings.capacity() * sizeof(std::string_view);
+  }
+
+  /// Returns id of the string, a new one if the string was not interned.
+  id_type intern(std::string_view sv);
+  /// Returns id of the string or no_id.
+  id_type find(std::string_view sv) const {
+    const id_type *id = m_table.find(sv);
+    return id ? *id : no_id;
+  }
+  /// The string of an interned id. The view is valid till clear().
+  std::string_view lookup_id(id_type id) const { return m_strings[id]; }
+
+  /// ids[i] = intern(keys[i]), keys are looked up in batches (see
+  /// string_hash_table_t::try_emplace_batch()).
+  void encode(const std::string_view *keys, size_t count, id_type *ids);
+  /// encode() of a column, see string_hash_table_t::try_emplace_column() for the layout and
+  /// padding.
+  void encode_column(const size_t *offsets, const char *chars, size_t count, id_type *ids);
+
+private:
+  table_type m_table;
+  std::vector<std::string_view> m_strings;  // by id
+
+  template <typename Map, typename Key>
+  id_type intern(Map &map, const Key &key, size_t hash, std::string_view sv);
+  template <bool Padded, typename Keys>
+  void encode(const Keys &keys, size_t count, id_type *ids);
+};
+
+template <typename Options>
+template <typename Map, typename Key>
+typename string_dictionary_t<Options>::id_type string_dictionary_t<Options>::intern(
+  Map &map, const Key &key, size_t hash, std::string_view sv) {
+  auto [slot, inserted] = m_table.emplace_slot(map, key, hash, std::forward_as_tuple(size()));
+  if (inserted) {
+    if (UNLIKELY(size() == no_id)) {
+      m_table.erase_hashed(sv, hash);
+      error("Dictionary overflow: %zu strings", size());
+    }
+    // Long keys' chars are in the arena already, inline ones move with their slots
+    if constexpr (std::is_same_v<typename Map::key_type, detail::string_key_ref>) {
+      m_strings.push_back(detail::to_string_view(slot->first));
+    } else {
+      m_strings.emplace_back(m_table.m_arena.copy(sv), std::size(sv));
+    }
+  }
+  return slot->second;
+}
+
+template <typename Options>
+typename string_dictionary_t<Options>::id_type string_dictionary_t<Options>::intern(
+  std::string_view sv) {
+  auto callback = [this, sv](auto &map, const auto &key, size_t hash) {
+    return intern(map, key, hash, sv);
+  };
+  return m_table.dispatch(detail::map_size_to_key_type(std::size(sv)), sv,
+                          table_type::hash_of(sv), callback);
+}
+
+template <typename Options>
+template <bool Padded, typename Keys>
+void string_dictionary_t<Options>::encode(const Keys &keys, size_t count, id_type *ids) {
+  m_table.template for_batch<Padded>(keys, count, [this, &keys, ids](size_t i, auto &map,
+                                                                       const auto &key,
+                                                                       size_t hash) {
+    ids[i] = intern(map, key, hash, keys(i));
+  });
+}
+
+template <typename Options>
+void string_dictionary_t<Options>::encode(const std::string_view *keys, size_t count,
+                                          id_type *ids) {
+  encode<false>([keys](size_t i) { return keys[i]; }, count, ids);
+}
+
+template <typename Options>
+void string_dictionary_t<Options>::encode_column(const size_t *offsets, const char *chars,
+                                                 size_t count, id_type *ids) {
+  encode<true>(table_type::column_keys(offsets, chars), count, ids);
+}
+
+
+/* ==TRASH==
+*/
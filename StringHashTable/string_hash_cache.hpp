@@ -0,0 +1,190 @@
+/// \file
+/// \brief Capacity-bounded string hash table with CLOCK eviction
+
+#pragma once
+
+#include "string_hash_table.hpp"
+#include <algorithm>
+#include <cstdint>
+#include <string_view>
+#include <utility>
+
+/// Operation counters of string_hash_cache_t.
+struct string_hash_cache_counters {
+  uint64_t hits = 0;       // find(), try_emplace() of cached keys
+  uint64_t misses = 0;     // find() of not cached keys
+  uint64_t inserts = 0;
+  uint64_t evictions = 0;
+};
+
+/// Eviction callback that does nothing.
+struct no_evict_t {
+  template <typename T>
+  void operator()(std::string_view, T &) const {}
+};
+
+/// String hash table bounded by an entry count and/or a byte budget, e.g. to cache results of an
+/// expensive computation. Once try_emplace() exceeds a limit, cold entries are evicted by the
+/// CLOCK (second chance) policy: every entry has a reference bit set by lookups, the clock hand
+/// sweeps slots of the submaps, clears the set bits and evicts the first entry having it clear.
+/// The bit lives in the entry, so lookups allocate nothing and there is no list to maintain.
+/// The byte budget covers slots and chars of long keys of the cached entries, not the free slots
+/// of the submaps: as the entry count is bounded, so is their capacity.
+/// evict(std::string_view key, mapped_type &) is called before an entry is evicted.
+template <typename T, typename Evict = no_evict_t, typename Options = string_hash_table_options>
+class string_hash_cache_t {
+  static_assert(!Options::arena_keys, "Chars of evicted keys would stay in the arena");
+  static_assert(!Options::dense_storage && !Options::incremental_rehash,
+                "The clock hand sweeps flat slots");
+
+public:
+  using key_type = string_hash_key_t;
+  using mapped_type = T;
+
+  static constexpr size_t unlimited = size_t(-1);
+
+  explicit string_hash_cache_t(size_t max_entries, size_t max_bytes = unlimited,
+                               Evict evict = Evict())
+    : m_max_entries(std::max<size_t>(max_entries, 1)), m_max_bytes(max_bytes),
+      m_evict(std::move(evict)) {}
+
+  bool empty() const noexcept { return m_table.empty(); }
+  size_t size() const noexcept { return m_table.size(); }
+  /// Bytes charged against the budget, see the class comment.
+  size_t bytes() const noexcept { return m_bytes; }
+  const string_hash_cache_counters &counters() const noexcept { return m_counters; }
+  /// Removes all the entries, without calling evict.
+  void clear() noexcept {
+    m_table.clear();
+    m_bytes = 0;
+    m_hand_map = m_hand_index = 0;
+  }
+
+  /// Finds the entry and marks it as referenced.
+  mapped_type *find(std::string_view key) {
+    entry_t *entry = m_table.find(key);
+    ++(entry ? m_counters.hits : m_counters.misses);
+    if (!entry) return nullptr;
+    entry->referenced = true;
+    return &entry->value;
+  }
+  /// Unlike find(), does not mark the entry.
+  bool contains(std::string_view key) const { return m_table.contains(key); }
+  /// Inserts mapped_type constructed from args unless the key is cached, as
+  /// string_hash_table_t::try_emplace(). An insertion evicts entries while over a limit, the
+  /// inserted entry is never evicted by its own insertion.
+  template <typename... Args>
+  std::pair<mapped_type *, bool> try_emplace(std::string_view key, Args &&... args);
+  /// Removes the entry, without calling evict.
+  bool erase(std::string_view key);
+
+private:
+  struct entry_t {
+    template <typename... Args>
+    explicit entry_t(std::in_place_t, Args &&... args) : value(std::forward<Args>(args)...) {}
+
+    T value;
+    bool referenced = false;
+  };
+  using table_type = string_hash_table_t<entry_t, Options>;
+
+  table_type m_table;
+  size_t m_max_entries;
+  size_t m_max_bytes;
+  Evict m_evict;
+  size_t m_bytes = 0;
+  string_hash_cache_counters m_counters;
+  // The clock hand: submap (by key type) and its slot
+  size_t m_hand_map = 0;
+  size_t m_hand_index = 0;
+
+  // Slot, control byte and chars of a long key
+  static size_t entry_bytes(std::string_view key);
+  bool over_limits() const { return size() > m_max_entries || m_bytes > m_max_bytes; }
+  template <typename F>
+  decltype(auto) with_map(size_t type, F &&f);
+  void evict_one(const entry_t *keep);
+};
+
+template <typename T, typename Evict, typename Options>
+size_t string_hash_cache_t<T, Evict, Options>::entry_bytes(std::string_view key) {
+  using table_t = table_type;  // for the submap types
+  switch (detail::map_size_to_key_type(std::size(key))) {
+    case detail::key_type0: return 1 + sizeof(typename decltype(table_t::m0)::value_type);
+    case detail::key_type8: return 1 + sizeof(typename decltype(table_t::m1)::value_type);
+    case detail::key_type16: return 1 + sizeof(typename decltype(table_t::m2)::value_type);
+    case detail::key_type24: return 1 + sizeof(typename decltype(table_t::m3)::value_type);
+    case detail::key_type_str:
+      return 1 + sizeof(typename decltype(table_t::ms)::value_type) + std::size(key);
+    default: UNREACHABLE();
+  }
+}
+
+template <typename T, typename Evict, typename Options>
+template <typename F>
+decltype(auto) string_hash_cache_t<T, Evict, Options>::with_map(size_t type, F &&f) {
+  switch (type) {
+    case detail::key_type0: return f(m_table.m0);
+    case detail::key_type8: return f(m_table.m1);
+    case detail::key_type16: return f(m_table.m2);
+    case detail::key_type24: return f(m_table.m3);
+    case detail::key_type_str: return f(m_table.ms);
+    default: UNREACHABLE();
+  }
+}
+
+template <typename T, typename Evict, typename Options>
+template <typename... Args>
+std::pair<typename string_hash_cache_t<T, Evict, Options>::mapped_type *, bool>
+string_hash_cache_t<T, Evict, Options>::try_emplace(std::string_view key, Args &&... args) {
+  auto [entry, inserted] = m_table.try_emplace(key, std::in_place, std::forward<Args>(args)...);
+  if (!inserted) {
+    ++m_counters.hits;
+    entry->referenced = true;
+    return {&entry->value, false};
+  }
+  ++m_counters.inserts;
+  m_bytes += entry_bytes(key);
+  // Slots do not move on erasure, so entry stays valid
+  while (over_limits() && size() > 1) evict_one(entry);
+  return {&entry->value, true};
+}
+
+template <typename T, typename Evict, typename Options>
+bool string_hash_cache_t<T, Evict, Options>::erase(std::string_view key) {
+  if (!m_table.erase(key)) return false;
+  m_bytes -= entry_bytes(key);
+  return true;
+}
+
+template <typename T, typename Evict, typename Options>
+void string_hash_cache_t<T, Evict, Options>::evict_one(const entry_t *keep) {
+  // Two sweeps at most: the first one may only clear the reference bits
+  for (;;) {
+    bool evicted = with_map(m_hand_map, [this, keep](auto &map) {
+      for (; m_hand_index < map.capacity(); ++m_hand_index) {
+        if (!map.full(m_hand_index)) continue;
+        auto &[key, entry] = map.slot(m_hand_index);
+        if (&entry == keep) continue;
+        if (entry.referenced) {
+          entry.referenced = false;
+          continue;
+        }
+        std::string_view sv = detail::to_string_view(key);
+        m_evict(sv, entry.value);
+        m_bytes -= entry_bytes(sv);
+        map.erase_at(m_hand_index++);
+        return true;
+      }
+      return false;
+    });
+    if (evicted) break;
+    m_hand_map = (m_hand_map + 1) % 5;
+    m_hand_index = 0;
+  }
+  ++m_counters.evictions;
+}
+
+
+/* ==TRASH==
+*/
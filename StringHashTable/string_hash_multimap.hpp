@@ -0,0 +1,171 @@
+/// \file
+/// \brief String hash multimap for hash joins
+
+#pragma once
+
+#include "string_hash_table.hpp"
+#include <algorithm>
+#include <cstdint>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+/// Hash multimap with string keys, the build side of a hash join: a key maps to any number of
+/// rows (e.g. row ids). Keys are stored once, by string_hash_table_t (so short keys stay inline
+/// in their size class), and map to key numbers. Rows live in a single array grouped by key: rows
+/// of a key are contiguous, in build order. Built rows are buffered with their key numbers; the
+/// first lookup after build moves them into the groups by a counting sort and releases the
+/// buffers, so rows are stored once.
+template <typename Row = uint32_t, typename Options = string_hash_table_options>
+class string_hash_multimap_t {
+public:
+  using mapped_type = Row;
+  using table_type = string_hash_table_t<uint32_t, Options>;  // key -> key number
+
+  /// Position of probe() in its keys, so matches are returned batch by batch.
+  struct probe_cursor_t {
+    size_t key = 0;  // the next key to probe
+    // Rows of the previous key not returned yet
+    size_t row = 0;
+    size_t end_row = 0;
+  };
+
+  bool empty() const noexcept { return !size(); }
+  size_t size() const noexcept { return std::size(m_rows) + std::size(m_build_rows); }  // rows
+  size_t key_count() const noexcept { return std::size(m_key_offsets) - 1; }
+  void clear();
+  void reserve(size_t key_count, size_t row_count) {
+    m_table.reserve(key_count);
+    m_key_offsets.reserve(key_count + 1);
+    m_rows.reserve(row_count);
+  }
+
+  /// Adds rows[i] under keys[i] for i in [0, count). Keys are looked up in batches, see
+  /// string_hash_table_t::try_emplace_batch().
+  void build(const std::string_view *keys, const Row *rows, size_t count);
+
+  /// Rows of the key as [first, last), they are valid till the next build().
+  std::pair<const Row *, const Row *> equal_range(std::string_view key);
+
+  /// Writes up to max_matches matches of keys[0, count) as (probe index, row) pairs into
+  /// indices[] and rows[], returns their number. A call continues from the cursor, the same keys
+  /// are probed till 0 is returned, so max_matches must be positive (throws std::runtime_error
+  /// otherwise). Keys are looked up in batches, see
+  /// string_hash_table_t::find_batch().
+  size_t probe(const std::string_view *keys, size_t count, probe_cursor_t &cursor,
+               size_t *indices, Row *rows, size_t max_matches);
+
+private:
+  static constexpr size_t block_size = 64;
+
+  table_type m_table;
+  // Grouped rows: rows of key number k are m_rows[m_key_offsets[k], m_key_offsets[k + 1])
+  std::vector<size_t> m_key_offsets = {0};
+  std::vector<Row> m_rows;
+  // Rows built since grouping, in build order, and their key numbers
+  std::vector<uint32_t> m_build_keys;
+  std::vector<Row> m_build_rows;
+
+  void group();
+};
+
+template <typename Row, typename Options>
+void string_hash_multimap_t<Row, Options>::clear() {
+  m_table.clear();
+  m_build_keys.clear();
+  m_build_rows.clear();
+  m_key_offsets.assign(1, 0);
+  m_rows.clear();
+}
+
+template <typename Row, typename Options>
+void string_hash_multimap_t<Row, Options>::build(const std::string_view *keys, const Row *rows,
+                                                 size_t count) {
+  uint32_t *found[block_size];
+  bool inserted[block_size];
+  for (size_t begin = 0; begin < count; begin += block_size) {
+    size_t n = std::min(block_size, count - begin);
+    m_table.try_emplace_batch(keys + begin, n, found, inserted);
+    for (size_t i = 0; i < n; ++i) {
+      if (inserted[i]) {
+        *found[i] = uint32_t(key_count());
+        m_key_offsets.push_back(std::size(m_rows));  // no grouped rows
+      }
+      m_build_keys.push_back(*found[i]);
+      m_build_rows.push_back(rows[begin + i]);
+    }
+  }
+}
+
+template <typename Row, typename Options>
+void string_hash_multimap_t<Row, Options>::group() {
+  std::vector<size_t> pos(key_count());  // built rows of key k, then where the next one goes
+  for (uint32_t k : m_build_keys) ++pos[k];
+  m_rows.resize(size());
+  // Groups grow by their built rows, so they move towards the end only: they are moved in place
+  // from the last one, then the built rows are appended to them in build order
+  size_t shift = std::size(m_build_rows);  // of the end of the group
+  for (size_t k = key_count(); k > 0; --k) {
+    size_t first = m_key_offsets[k - 1];
+    size_t last = m_key_offsets[k];
+    m_key_offsets[k] += shift;
+    shift -= pos[k - 1];
+    std::move_backward(std::begin(m_rows) + first, std::begin(m_rows) + last,
+                       std::begin(m_rows) + last + shift);
+    pos[k - 1] = last + shift;
+  }
+  for (size_t i = 0; i < std::size(m_build_rows); ++i) {
+    m_rows[pos[m_build_keys[i]]++] = std::move(m_build_rows[i]);
+  }
+  m_build_keys.clear();
+  m_build_keys.shrink_to_fit();
+  m_build_rows.clear();
+  m_build_rows.shrink_to_fit();
+}
+
+template <typename Row, typename Options>
+std::pair<const Row *, const Row *> string_hash_multimap_t<Row, Options>::equal_range(
+  std::string_view key) {
+  if (!m_build_rows.empty()) group();
+  const uint32_t *k = m_table.find(key);
+  if (!k) return {nullptr, nullptr};
+  return {std::data(m_rows) + m_key_offsets[*k], std::data(m_rows) + m_key_offsets[*k + 1]};
+}
+
+template <typename Row, typename Options>
+size_t string_hash_multimap_t<Row, Options>::probe(const std::string_view *keys, size_t count,
+                                                   probe_cursor_t &cursor, size_t *indices,
+                                                   Row *rows, size_t max_matches) {
+  if (UNLIKELY(!max_matches)) error("Multimap probe: max_matches is 0");
+  if (!m_build_rows.empty()) group();
+  size_t res = 0;
+  // Returns false if out of space
+  auto emit = [&](size_t index, size_t &row, size_t end_row) {
+    for (; row < end_row; ++row) {
+      if (res == max_matches) return false;
+      indices[res] = index;
+      rows[res++] = m_rows[row];
+    }
+    return true;
+  };
+  if (!emit(cursor.key - 1, cursor.row, cursor.end_row)) return res;
+  uint32_t *found[block_size];
+  while (cursor.key < count) {
+    size_t n = std::min(block_size, count - cursor.key);
+    m_table.find_batch(keys + cursor.key, n, found);
+    for (size_t i = 0; i < n; ++i) {
+      // Note: the keys after the one out of space are probed again by the next call
+      if (res == max_matches) return res;
+      ++cursor.key;
+      if (!found[i]) continue;
+      cursor.row = m_key_offsets[*found[i]];
+      cursor.end_row = m_key_offsets[*found[i] + 1];
+      if (!emit(cursor.key - 1, cursor.row, cursor.end_row)) return res;
+    }
+  }
+  return res;
+}
+
+
+/* ==TRASH==
+*/
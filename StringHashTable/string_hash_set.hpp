@@ -0,0 +1,83 @@
+/// \file
+/// \brief String hash set
+
+#pragma once
+
+#include "string_hash_table.hpp"
+#include <algorithm>
+#include <string_view>
+#include <utility>
+
+/// Hash set of strings, e.g. for distinct counting and deduplication. It's string_hash_table_t
+/// without mapped values: slots of the submaps hold keys only (see detail::key_slot_t), so a key
+/// of up to 8 chars takes 8 bytes plus a control byte, one of up to 24 chars takes 24 bytes.
+template <typename Options = string_hash_table_options>
+class string_hash_set_t {
+public:
+  using key_type = string_hash_key_t;
+  using table_type = string_hash_table_t<detail::no_mapped_t, Options>;
+
+  bool empty() const noexcept { return m_table.empty(); }
+  size_t size() const noexcept { return m_table.size(); }
+  void clear() noexcept { m_table.clear(); }
+  void reserve(size_t elem_count) { m_table.reserve(elem_count); }
+  /// Note: it's O(capacity), see string_hash_table_t::stats().
+  string_hash_table_stats_t stats() const { return m_table.stats(); }
+  size_t memory_bytes() const noexcept { return m_table.memory_bytes(); }
+
+  /// Returns true if the key was not in the set.
+  bool insert(std::string_view key) { return m_table.try_emplace(key).second; }
+  bool contains(std::string_view key) const { return m_table.contains(key); }
+  /// Returns true if the key was in the set.
+  bool erase(std::string_view key) { return m_table.erase(key); }
+
+  /// inserted[i] = insert(keys[i]) (if inserted is given), see
+  /// string_hash_table_t::try_emplace_batch().
+  void insert_batch(const std::string_view *keys, size_t count, bool *inserted = nullptr);
+  /// out[i] = contains(keys[i]), see string_hash_table_t::find_batch().
+  void contains_batch(const std::string_view *keys, size_t count, bool *out);
+
+  /// Calls f(string_hash_key_t &&) for every key.
+  template <typename F>
+  void for_each(F &&f) const {
+    m_table.for_each([&f](string_hash_key_t &&key, detail::no_mapped_t) { f(std::move(key)); });
+  }
+  /// Calls f(std::string_view key, size_t hash) for every key, see
+  /// string_hash_table_t::for_each_hashed().
+  template <typename F>
+  void for_each_hashed(F &&f) const {
+    m_table.for_each_hashed([&f](std::string_view key, size_t hash, detail::no_mapped_t) {
+      f(key, hash);
+    });
+  }
+
+private:
+  static constexpr size_t block_size = 64;
+
+  table_type m_table;
+};
+
+template <typename Options>
+void string_hash_set_t<Options>::insert_batch(const std::string_view *keys, size_t count,
+                                              bool *inserted) {
+  detail::no_mapped_t *found[block_size];
+  for (size_t begin = 0; begin < count; begin += block_size) {
+    size_t n = std::min(block_size, count - begin);
+    m_table.try_emplace_batch(keys + begin, n, found, inserted ? inserted + begin : nullptr);
+  }
+}
+
+template <typename Options>
+void string_hash_set_t<Options>::contains_batch(const std::string_view *keys, size_t count,
+                                                bool *out) {
+  detail::no_mapped_t *found[block_size];
+  for (size_t begin = 0; begin < count; begin += block_size) {
+    size_t n = std::min(block_size, count - begin);
+    m_table.find_batch(keys + begin, n, found);
+    for (size_t i = 0; i < n; ++i) out[begin + i] = found[i];
+  }
+}
+
+
+/* ==TRASH==
+*/
@@ -1,15 +1,26 @@
 /// \file
 /// \brief String hash table
 
+#pragma once
+
+#include "arena.hpp"
+#include "block_filter.hpp"
+#include "dense_map.hpp"
+#include "flat_map.hpp"
+#include "hash.hpp"
 #include "utils.hpp"
+#include <algorithm>
+#include <cstdint>
 #include <cstring>
+#include <functional>
 #include <memory>
 #include <string>
 #include <string_view>
+#include <thread>
 #include <tuple>
+#include <type_traits>
 #include <variant>
-#include <unordered_map>
-#include <smmintrin.h>
+#include <vector>
 
 //TODO:remove ALWAYS_INLINE
 
@@ -30,12 +41,28 @@ struct string_key24 {
   uint64_t c;
 };
 
-struct string_key_str {  // for string keys with length > 24 chars
+// Inline part of keys with length > 24 chars: length, hash and the first 8 chars. Most of
+// mismatches are rejected by comparing heads only, without dereferencing the chars.
+struct string_key_head {
+  uint32_t size;  // so keys are shorter than 4GB, see to_string_key_head()
+  uint32_t hash;  // CRC32 based hashes fit
+  uint64_t prefix;
+};
+
+inline bool ALWAYS_INLINE equal_heads(const string_key_head &left, const string_key_head &right) {
+  return left.size == right.size && left.hash == right.hash && left.prefix == right.prefix;
+}
+
+// Compares the chars after prefix, heads are supposed to be equal.
+inline bool ALWAYS_INLINE equal_tails(const string_key_head &head, const char *left,
+                                      const char *right) {
+  return !memcmp(left + 8, right + 8, head.size - 8);
+}
+
+struct string_key_str : string_key_head {  // for string keys with length > 24 chars
   // Note: by design, string hash table and its keys may exist independently. So, we share
   // string data (as raw char buffer, concretely).
   std::shared_ptr<char[]> data;
-  size_t size;
-  size_t hash;
 };
 
 inline bool ALWAYS_INLINE operator==(string_key0, string_key0) { return true; }
@@ -46,8 +73,31 @@ inline bool ALWAYS_INLINE operator==(const string_key24 &left, const string_key2
   return left.a == right.a && left.b == right.b && left.c == right.c;
 }
 inline bool ALWAYS_INLINE operator==(const string_key_str &left, const string_key_str &right) {
-  return left.data == right.data
-    || (left.size == right.size && !memcmp(left.data.get(), right.data.get(), left.size));
+  return equal_heads(left, right)
+    && (left.data == right.data || equal_tails(left, left.data.get(), right.data.get()));
+}
+
+// Lookup key for strings with length > 24 chars: it refers to the string instead of copying it,
+// so probing a table does not allocate.
+struct string_key_view : string_key_head {
+  const char *data;
+};
+
+inline bool ALWAYS_INLINE operator==(const string_key_str &left, const string_key_view &right) {
+  return equal_heads(left, right) && equal_tails(left, left.data.get(), right.data);
+}
+
+// Stored key for strings with length > 24 chars, refers to chars owned by the table's arena.
+struct string_key_ref : string_key_head {
+  const char *data;
+};
+static_assert(sizeof(string_key_ref) == 24);
+
+inline bool ALWAYS_INLINE operator==(const string_key_ref &left, const string_key_str &right) {
+  return equal_heads(left, right) && equal_tails(left, left.data, right.data.get());
+}
+inline bool ALWAYS_INLINE operator==(const string_key_ref &left, const string_key_view &right) {
+  return equal_heads(left, right) && equal_tails(left, left.data, right.data);
 }
 
 enum key_type {
@@ -68,41 +118,26 @@ inline key_type ALWAYS_INLINE map_size_to_key_type(size_t size) {
   return key_type24;
 }
 
-inline size_t ALWAYS_INLINE hash(std::string_view sv) {
-  size_t res = size_t(-1ULL);
-  size_t sz = std::size(sv);
-  const char *p = std::data(sv);
-  const char *lp = p + sz - 8; // starting pointer of the last 8 bytes segment
-  char s = (-sz & 7) * 8; // pending bits that needs to be shifted out
-  uint64_t n[3]; // std::string_view in SSO map will have length > 24
-  memcpy(&n, p, 24);
-  res = _mm_crc32_u64(res, n[0]);
-  res = _mm_crc32_u64(res, n[1]);
-  res = _mm_crc32_u64(res, n[2]);
-  p += 24;
-  while (p + 8 < lp) {
-    memcpy(&n[0], p, 8);
-    res = _mm_crc32_u64(res, n[0]);
-    p += 8;
-  }
-  memcpy(&n[0], lp, 8);
-  n[0] >>= s;
-  res = _mm_crc32_u64(res, n[0]);
-  return res;
+// Hash of strings with length > 24 chars.
+inline uint32_t ALWAYS_INLINE hash(std::string_view sv) {
+  return hash_kernel().fn(std::data(sv), std::size(sv));
 }
 
 inline int ALWAYS_INLINE shifting_bits(std::string_view sv) { return (-std::size(sv) & 7) << 3; };
 
+// 1..8 chars: only the chars are loaded, by two overlapping words of 4 or three single chars, so
+// a key at the end of a page or of an object is never read past
 inline string_key8 ALWAYS_INLINE to_string_key8(std::string_view sv) {
-  string_key8 ret;
-  if ((reinterpret_cast<uintptr_t>(std::data(sv)) & 2048) == 0) { // first half page
-    memcpy(&ret, std::data(sv), 8);
-    ret &= uint64_t(-1) >> shifting_bits(sv);
-  } else {
-    memcpy(&ret, std::data(sv) + std::size(sv) - 8, 8);
-    ret >>= shifting_bits(sv);
+  const char *data = std::data(sv);
+  const size_t size = std::size(sv);
+  if (size >= 4) {
+    uint32_t lo, hi;
+    memcpy(&lo, data, 4);
+    memcpy(&hi, data + size - 4, 4);
+    return lo | uint64_t(hi) << ((size - 4) << 3);
   }
-  return ret;
+  return uint64_t(uint8_t(data[0])) | uint64_t(uint8_t(data[size >> 1])) << ((size >> 1) << 3)
+    | uint64_t(uint8_t(data[size - 1])) << ((size - 1) << 3);
 }
 inline string_key16 ALWAYS_INLINE to_string_key16(std::string_view sv) {
   string_key16 ret;
@@ -118,10 +153,50 @@ inline string_key24 ALWAYS_INLINE to_string_key24(std::string_view sv) {
   ret.c >>= shifting_bits(sv);
   return ret;
 }
+// Versions for keys followed by at least 8 readable bytes (e.g. padding of a chars column): whole
+// words are loaded and masked, no page boundary is checked. The keys are the same.
+inline string_key8 ALWAYS_INLINE to_padded_string_key8(std::string_view sv) {
+  string_key8 ret;
+  memcpy(&ret, std::data(sv), 8);
+  return ret & uint64_t(-1) >> shifting_bits(sv);
+}
+inline string_key16 ALWAYS_INLINE to_padded_string_key16(std::string_view sv) {
+  string_key16 ret;
+  memcpy(&ret, std::data(sv), 16);
+  ret.b &= uint64_t(-1) >> shifting_bits(sv);
+  return ret;
+}
+inline string_key24 ALWAYS_INLINE to_padded_string_key24(std::string_view sv) {
+  string_key24 ret;
+  memcpy(&ret, std::data(sv), 24);
+  ret.c &= uint64_t(-1) >> shifting_bits(sv);
+  return ret;
+}
+inline string_key_head ALWAYS_INLINE to_string_key_head(std::string_view sv, size_t hash) {
+  if (UNLIKELY(std::size(sv) > UINT32_MAX)) error("Key of %zu chars is too long", std::size(sv));
+  string_key_head ret{uint32_t(std::size(sv)), uint32_t(hash), 0};
+  memcpy(&ret.prefix, std::data(sv), 8);
+  return ret;
+}
+inline string_key_str ALWAYS_INLINE to_string_key_str(const string_key_head &head,
+                                                      const char *chars) {
+  char *data = new char[head.size];
+  memcpy(data, chars, head.size);
+  return string_key_str{head, std::shared_ptr<char[]>(data)};
+}
 inline string_key_str ALWAYS_INLINE to_string_key_str(std::string_view sv) {
-  char *data = new char[std::size(sv)];
-  memcpy(data, std::data(sv), std::size(sv));
-  return string_key_str{std::shared_ptr<char[]>(data), std::size(sv), hash(sv)};
+  return to_string_key_str(to_string_key_head(sv, hash(sv)), std::data(sv));
+}
+inline string_key_view ALWAYS_INLINE to_string_key_view(std::string_view sv) {
+  return string_key_view{to_string_key_head(sv, hash(sv)), std::data(sv)};
+}
+
+// Key to store from a lookup key. Only long keys are looked up by reference (with already
+// calculated hash) and need copying.
+template <typename K>
+inline const K & ALWAYS_INLINE to_stored_key(const K &key) { return key; }
+inline string_key_str ALWAYS_INLINE to_stored_key(const string_key_view &key) {
+  return to_string_key_str(key, key.data);
 }
 
 // Warning: passing input parameter by ref. is mandatory - otherwise string_view will point to
@@ -139,32 +214,136 @@ inline std::string_view ALWAYS_INLINE to_string_view(const string_key24 &key) {
 inline std::string_view ALWAYS_INLINE to_string_view(const string_key_str &key) {
   return std::string_view(key.data.get(), key.size);
 }
+inline std::string_view ALWAYS_INLINE to_string_view(const string_key_view &key) {
+  return std::string_view(key.data, key.size);
+}
+inline std::string_view ALWAYS_INLINE to_string_view(const string_key_ref &key) {
+  return std::string_view(key.data, key.size);
+}
 
 struct hasher_t {
   size_t ALWAYS_INLINE operator()(string_key0) const { return 0; }
   size_t ALWAYS_INLINE operator()(string_key8 key) const {
-    size_t res = size_t(-1ULL);
-    res = _mm_crc32_u64(res, key);
+    uint32_t res = uint32_t(-1);
+    res = crc32_u64(res, key);
     return res;
   }
   size_t ALWAYS_INLINE operator()(string_key16 key) const {
-    size_t res = size_t(-1ULL);
-    res = _mm_crc32_u64(res, key.a);
-    res = _mm_crc32_u64(res, key.b);
+    uint32_t res = uint32_t(-1);
+    res = crc32_u64(res, key.a);
+    res = crc32_u64(res, key.b);
     return res;
   }
   size_t ALWAYS_INLINE operator()(const string_key24 &key) const {
-    size_t res = size_t(-1ULL);
-    res = _mm_crc32_u64(res, key.a);
-    res = _mm_crc32_u64(res, key.b);
-    res = _mm_crc32_u64(res, key.c);
+    uint32_t res = uint32_t(-1);
+    res = crc32_u64(res, key.a);
+    res = crc32_u64(res, key.b);
+    res = crc32_u64(res, key.c);
     return res;
   }
   size_t ALWAYS_INLINE operator()(const string_key_str &key) const { return key.hash; }
+  size_t ALWAYS_INLINE operator()(const string_key_view &key) const { return key.hash; }
+  size_t ALWAYS_INLINE operator()(const string_key_ref &key) const { return key.hash; }
 };
 
+// Hash of the string key that sv of the given key type is stored as. Padded: sv is followed by
+// at least 8 readable bytes.
+template <bool Padded = false>
+inline size_t ALWAYS_INLINE string_key_hash(key_type type, std::string_view sv) {
+  switch (type) {
+    case key_type0: return hasher_t()(string_key0());
+    case key_type8: return hasher_t()(Padded ? to_padded_string_key8(sv) : to_string_key8(sv));
+    case key_type16: return hasher_t()(Padded ? to_padded_string_key16(sv) : to_string_key16(sv));
+    case key_type24: return hasher_t()(Padded ? to_padded_string_key24(sv) : to_string_key24(sv));
+    case key_type_str: return hash(sv);
+    default: UNREACHABLE();
+  };
+}
+
+class string_hash_key_t;
+
+// Types a string_view is constructible from (literals, std::string etc.), except for
+// string_hash_key_t.
+template <typename K, typename R>
+using if_string_like_t = std::enable_if_t<std::is_convertible_v<const K &, std::string_view>
+  && !std::is_same_v<K, string_hash_key_t>, R>;
+
 } // detail::
 
+/// Compile-time options of string_hash_table_t.
+struct string_hash_table_options {
+  /// Long (> 24 chars) keys are copied into an arena owned by the table rather than into
+  /// individually allocated shared buffers. The arena is released by clear() only, erased keys
+  /// keep their chars till then.
+  static constexpr bool arena_keys = false;
+  /// Operation counters are maintained (see string_hash_table_stats_t), they cost nothing
+  /// otherwise. They are plain integers: lookups modify them, so concurrent_string_hash_table_t
+  /// serializes lookups of a shard (exclusive locks) with counters.
+  static constexpr bool counters = false;
+  /// Insertions are counted per key length class. Then reserve(elem_count) splits elements by
+  /// the observed class mix rather than evenly, and when a submap grows on insertion, the other
+  /// ones are grown along by the mix.
+  static constexpr bool adaptive_reserve = false;
+  /// Submaps rehash incrementally: growth on insertion does not move all the elements at once,
+  /// they are migrated by the following insertions (see detail::flat_map_t).
+  static constexpr bool incremental_rehash = false;
+  /// Submaps keep elements in dense arrays indexed by 32-bit element numbers (see
+  /// detail::dense_map_t), so for_each() and export_columns() are sequential passes. Pointers to
+  /// mapped values are invalidated by erasure too then. Incremental rehashing does not apply.
+  static constexpr bool dense_storage = false;
+  /// Long (> 24 chars) keys' hashes are added to a split block Bloom filter (see
+  /// detail::filtered_map_t), lookups of keys it rejects do not probe the long key submap.
+  /// Note: a miss in a flat submap costs about a control group load already, so the filter
+  /// (another load) pays off only if it stays cached while the submap does not, measure it (see
+  /// bench). Erased keys stay in the filter till rebuild_filter().
+  static constexpr bool long_key_filter = false;
+};
+
+struct arena_string_hash_table_options : string_hash_table_options {
+  static constexpr bool arena_keys = true;
+};
+
+struct dense_string_hash_table_options : string_hash_table_options {
+  static constexpr bool dense_storage = true;
+};
+
+struct incremental_string_hash_table_options : string_hash_table_options {
+  static constexpr bool incremental_rehash = true;
+};
+
+struct filtered_string_hash_table_options : string_hash_table_options {
+  static constexpr bool long_key_filter = true;
+};
+
+/// Operation counters of string_hash_table_t, if Options::counters.
+struct string_hash_table_counters {
+  uint64_t hits = 0;      // find(), try_emplace(), erase() etc. of contained keys
+  uint64_t misses = 0;    // find(), erase() of not contained keys
+  uint64_t inserts = 0;
+  uint64_t rehashes = 0;  // caused by insertion
+};
+
+/// Statistics of string_hash_table_t, see string_hash_table_t::stats().
+struct string_hash_table_stats_t {
+  static constexpr size_t class_count = 5;
+  static constexpr const char *class_names[class_count] = {"0", "1..8", "9..16", "17..24", ">24"};
+
+  detail::flat_map_stats_t classes[class_count];  // submaps by key length class
+  detail::block_filter_stats_t long_key_filter;   // zeros unless Options::long_key_filter
+  size_t size = 0;
+  size_t key_bytes = 0;     // chars of long keys (own buffers or arena pages)
+  size_t memory_bytes = 0;  // submaps and key_bytes
+  string_hash_table_counters counters;  // zeros unless Options::counters
+};
+
+template <typename T, typename Options = string_hash_table_options>
+class string_hash_table_t;
+
+template <typename T>
+using arena_string_hash_table_t = string_hash_table_t<T, arena_string_hash_table_options>;
+template <typename T>
+using dense_string_hash_table_t = string_hash_table_t<T, dense_string_hash_table_options>;
+
 // string_hash_key_t
 
 /// User side key to be used with string_hash_table_t.
@@ -185,8 +364,10 @@ public:
   operator std::string_view() const { return to_string_view(); }
 
 private:
+  // Must follow detail::key_type enum. The last one is a long key borrowed from an arena table
+  // (see string_hash_table_t::for_each()), it refers to the table's chars.
   using data_t = std::variant<detail::string_key0, detail::string_key8, detail::string_key16,
-    detail::string_key24, detail::string_key_str>;  // must follow detail::key_type enum
+    detail::string_key24, detail::string_key_str, detail::string_key_view>;
   data_t m_data;
 
   static data_t to_data(std::string_view sv) {
@@ -200,18 +381,30 @@ private:
     };
   }
 
-  template <typename T> friend class string_hash_table_t;
+  template <typename T, typename Options> friend class string_hash_table_t;
   // Used by string_hash_table_t:
   template <typename T>
   string_hash_key_t(const T &string_key) : m_data(string_key) {}
-  detail::key_type type() const { return detail::key_type(m_data.index()); }
+  detail::key_type type() const {
+    return detail::key_type(std::min<size_t>(m_data.index(), detail::key_type_str));
+  }
+  bool borrowed() const { return m_data.index() > detail::key_type_str; }
   template <size_t I>
-  auto get_string_key() const { return std::get<I>(m_data); }
+  const auto &get_string_key() const { return std::get<I>(m_data); }
 };
 
 // string_hash_table_t
 
-template <typename T>
+template <typename Options> class string_dictionary_t;
+template <typename T, typename Evict, typename Options> class string_hash_cache_t;
+
+/// Hash table with string keys. Keys are split by length into size classes, each class has its
+/// own flat open-addressing submap: empty keys, 1..8, 9..16 and 17..24 char keys are stored inline
+/// as 1..3 integers, longer keys are stored along with their hashes. Keys of 4GB and more are
+/// rejected: any operation on them throws.
+/// Pointers to mapped values (returned by find(), try_emplace()) are invalidated by insertion
+/// (and by erasure, if Options::dense_storage).
+template <typename T, typename Options>
 class string_hash_table_t {
 public:
   using key_type = string_hash_key_t;
@@ -219,8 +412,26 @@ public:
 
   string_hash_table_t() {}
   string_hash_table_t(size_t elem_count) { reserve(elem_count); }  // elements, not buckets!
+  string_hash_table_t(const string_hash_table_t &other)
+    : m0(other.m0), m1(other.m1), m2(other.m2), m3(other.m3), ms(other.ms),
+      m_class_mix(other.m_class_mix) {
+    if constexpr (Options::arena_keys) {
+      for (auto &slot : ms) {
+        slot.first.data = m_arena.copy(detail::to_string_view(slot.first));
+      }
+    }
+  }
+  string_hash_table_t(string_hash_table_t &&other) = default;
+  string_hash_table_t &operator=(const string_hash_table_t &other) {
+    if (this != &other) *this = string_hash_table_t(other);
+    return *this;
+  }
+  string_hash_table_t &operator=(string_hash_table_t &&other) = default;
 
   void reserve(size_t elem_count) {
+    if constexpr (Options::adaptive_reserve) {
+      if (reserve_by_mix(elem_count)) return;
+    }
     if (elem_count < 5) {
       elem_count = 5;
     }
@@ -230,6 +441,27 @@ public:
     m3.reserve(subcount);
     ms.reserve(elem_count - subcount * 3);
   }
+  /// Reserves for keys by their length histogram: length_counts[i] is the number of keys with
+  /// length i. Long (> 24 chars) keys may be counted at any i > 24.
+  void reserve(const size_t *length_counts, size_t count) {
+    size_t class_counts[5] = {};
+    for (size_t i = 0; i < count; ++i) {
+      class_counts[detail::map_size_to_key_type(i)] += length_counts[i];
+    }
+    reserve_classes(class_counts);
+  }
+  /// Reserves for elem_count keys distributed by length like the sample ones.
+  void reserve(size_t elem_count, const std::string_view *sample, size_t sample_count) {
+    if (!sample_count) return reserve(elem_count);
+    size_t class_counts[5] = {};
+    for (size_t i = 0; i < sample_count; ++i) {
+      ++class_counts[detail::map_size_to_key_type(std::size(sample[i]))];
+    }
+    for (size_t &class_count : class_counts) {
+      class_count = (class_count * elem_count + sample_count - 1) / sample_count;
+    }
+    reserve_classes(class_counts);
+  }
 
   bool empty() const noexcept {
     return m0.empty() && m1.empty() && m2.empty() && m3.empty() && ms.empty();
@@ -245,15 +477,141 @@ public:
     m2.clear();
     m3.clear();
     ms.clear();
+    m_arena.clear();
+  }
+
+  /// Note: it's O(capacity), see detail::flat_map_t::stats().
+  string_hash_table_stats_t stats() const;
+  /// Rebuilds the long key filter (if Options::long_key_filter) of the current keys, e.g. after
+  /// heavy erasure: erased keys' bits raise its false positive rate.
+  void rebuild_filter() {
+    if constexpr (Options::long_key_filter) ms.rebuild_filter();
+  }
+  /// Submaps and arena (if Options::arena_keys) in O(1), e.g. to keep the table under a memory
+  /// budget. Unlike stats().memory_bytes, own buffers of long keys are not counted.
+  size_t memory_bytes() const noexcept {
+    return m0.memory_bytes() + m1.memory_bytes() + m2.memory_bytes() + m3.memory_bytes()
+      + ms.memory_bytes() + m_arena.allocated_bytes();
   }
 
   mapped_type *find(const key_type &key);
+  // Note: try_emplace(), operator[]() and insert_or_assign() hash the key and probe the table
+  // once, the probed slot is reused for insertion.
   template <typename... Args>
   std::pair<mapped_type *, bool> try_emplace(const key_type &key, Args &&... args);
+  mapped_type &operator[](const key_type &key) { return *try_emplace(key).first; }
+  template <typename M>
+  std::pair<mapped_type *, bool> insert_or_assign(const key_type &key, M &&obj);
   bool erase(const key_type &key);
+  bool contains(const key_type &key) { return find(key); }
+
+  // Heterogeneous versions: the key is used in place, it's copied only on actual insertion.
+  template <typename K>
+  detail::if_string_like_t<K, mapped_type *> find(const K &key);
+  template <typename K, typename... Args>
+  detail::if_string_like_t<K, std::pair<mapped_type *, bool>> try_emplace(const K &key,
+                                                                           Args &&... args);
+  template <typename K>
+  detail::if_string_like_t<K, mapped_type &> operator[](const K &key) {
+    return *try_emplace(key).first;
+  }
+  template <typename K, typename M>
+  detail::if_string_like_t<K, std::pair<mapped_type *, bool>> insert_or_assign(const K &key,
+                                                                                M &&obj);
+  template <typename K>
+  detail::if_string_like_t<K, bool> erase(const K &key);
+  template <typename K>
+  detail::if_string_like_t<K, bool> contains(const K &key) { return find(key); }
+
+  // Aggregation: if the key is absent, it's inserted with mapped_type(value), otherwise
+  // combine(mapped_type &, value) is called for the contained value (e.g. to count or sum). It
+  // probes once, like try_emplace(). Returns the contained value and whether it was inserted.
+  template <typename V, typename F>
+  std::pair<mapped_type *, bool> upsert(const key_type &key, V &&value, F &&combine);
+  template <typename K, typename V, typename F>
+  detail::if_string_like_t<K, std::pair<mapped_type *, bool>> upsert(const K &key, V &&value,
+                                                                      F &&combine);
+
+  // Const lookups, e.g. for tables shared by readers. Note: Options::counters are still counted,
+  // it's not thread-safe then.
+  const mapped_type *find(const key_type &key) const {
+    return const_cast<string_hash_table_t *>(this)->find(key);
+  }
+  bool contains(const key_type &key) const { return find(key); }
+  template <typename K>
+  detail::if_string_like_t<K, const mapped_type *> find(const K &key) const {
+    return const_cast<string_hash_table_t *>(this)->find(key);
+  }
+  template <typename K>
+  detail::if_string_like_t<K, bool> contains(const K &key) const { return find(key); }
 
+  // Batched versions: keys are processed in blocks, a block is classified by key type, hashed
+  // and the first probed groups are prefetched for all its keys before probing. So memory
+  // latency of probes overlaps.
+  /// out[i] = find(keys[i])
+  void find_batch(const std::string_view *keys, size_t count, mapped_type **out);
+  /// out[i] = try_emplace(keys[i]).first, inserted[i] = try_emplace(keys[i]).second (if given).
+  /// Submaps are reserved for all the keys beforehand, so all the returned pointers are valid
+  /// upon return.
+  void try_emplace_batch(const std::string_view *keys, size_t count, mapped_type **out,
+                         bool *inserted = nullptr);
+  /// upsert(keys[i], values[i], combine) for every i, in order of i. Unlike try_emplace_batch()
+  /// nothing is reserved beforehand: group-by input has far fewer keys than rows.
+  template <typename V, typename F>
+  void accumulate(const std::string_view *keys, const V *values, size_t count, F &&combine);
+
+  // Column versions of the batched ones: key i is chars[offsets[i], offsets[i + 1]), offsets
+  // has count + 1 entries (as export_columns() writes them). The caller guarantees that at least
+  // 8 bytes past the last key are readable (padding of the chars). So short keys are loaded by
+  // whole words and masked, without checking page boundaries, and nothing is made per key.
+  void find_column(const size_t *offsets, const char *chars, size_t count, mapped_type **out);
+  void try_emplace_column(const size_t *offsets, const char *chars, size_t count,
+                          mapped_type **out, bool *inserted = nullptr);
+  template <typename V, typename F>
+  void accumulate_column(const size_t *offsets, const char *chars, size_t count, const V *values,
+                         F &&combine);
+
+  // Prehashed versions: hash is hash_of(key), so a caller that needs the hash anyway (e.g. to
+  // pick a shard) does not hash twice.
+  static size_t hash_of(std::string_view key) {
+    return detail::string_key_hash(detail::map_size_to_key_type(std::size(key)), key);
+  }
+  mapped_type *find_hashed(std::string_view key, size_t hash);
+  template <typename... Args>
+  std::pair<mapped_type *, bool> try_emplace_hashed(std::string_view key, size_t hash,
+                                                    Args &&... args);
+  bool erase_hashed(std::string_view key, size_t hash);
+  /// Calls f(std::string_view key, size_t hash, const mapped_type &) for every element, hash is
+  /// hash_of(key). The key refers to the table, no copy is made.
+  template <typename F>
+  void for_each_hashed(F &&f) const;
+  /// The same for a part of the elements: slots of every submap are split into part_count
+  /// ranges, part selects one. Parts are disjoint and cover all the elements, so threads may
+  /// traverse parts of a table (not modified meanwhile) in parallel.
+  template <typename F>
+  void for_each_hashed(size_t part, size_t part_count, F &&f) const;
+
+  // Columnar export, elements go in the order of for_each_hashed().
+  /// Total length of the keys, i.e. the size of the chars column. Note: it's O(size()).
+  size_t key_chars_size() const;
+  /// Key i is chars[offsets[i], offsets[i + 1]), its value is assigned to values[i] (unless
+  /// values is nullptr). offsets has size() + 1 entries, chars has key_chars_size() ones.
+  void export_columns(size_t *offsets, char *chars, mapped_type *values) const;
+
+  /// Folds other into the table: absent keys are inserted with copies of other's values, values
+  /// of present ones are combined by combiner(mapped_type &, const mapped_type &). Other is a
+  /// string_hash_table_t (of any options) other than this. With thread_count > 1, size classes
+  /// are merged by threads of their own (5 at most), the combiner must be thread-safe then.
+  /// Note: Options::counters and Options::adaptive_reserve update state shared by the classes,
+  /// such tables are merged by the calling thread.
+  template <typename Other, typename F>
+  void merge(const Other &other, F &&combiner, unsigned thread_count = 1);
+
+  /// Calls f(string_hash_key_t &&, const mapped_type &) for every element. Long keys of
+  /// Options::arena_keys tables borrow the arena chars (no copy is made), so they are valid till
+  /// clear(); string_hash_key_t(std::string_view(key)) is an own copy.
   template<typename F>
-  void for_each(F &&f) {
+  void for_each(F &&f) const {
     for (const auto &[first, second] : m0) {
       f(first, second);
     }
@@ -267,104 +625,619 @@ public:
       f(first, second);
     }
     for (const auto &[first, second] : ms) {
-      f(first, second);
+      if constexpr (Options::arena_keys) {
+        // Note: the key borrows the arena chars rather than copying them.
+        f(key_type(detail::string_key_view{first, first.data}), second);
+      } else {
+        f(first, second);
+      }
     }
   }
 
 private:
-  //OPTIMIZATION: using a custom fake container (that mimics std::unordered_map)
-  // to store a single value for string_key0, we save a bucket size bytes of
-  // memory.
-  std::unordered_map<detail::string_key0, T, detail::hasher_t> m0;
-  std::unordered_map<detail::string_key8, T, detail::hasher_t> m1;
-  std::unordered_map<detail::string_key16, T, detail::hasher_t> m2;
-  std::unordered_map<detail::string_key24, T, detail::hasher_t> m3;
-  std::unordered_map<detail::string_key_str, T, detail::hasher_t> ms;
+  template <typename U, typename OtherOptions> friend class string_hash_table_t;
+  // Interns keys through the submaps, see emplace_slot()
+  template <typename DictionaryOptions> friend class string_dictionary_t;
+  // Sweeps the submaps' slots for eviction
+  template <typename CacheT, typename Evict, typename CacheOptions>
+  friend class string_hash_cache_t;
+
+  template <typename K>
+  using map_t = std::conditional_t<Options::dense_storage,
+                                   detail::dense_map_t<K, T, detail::hasher_t>,
+                                   detail::flat_map_t<K, T, detail::hasher_t,
+                                                      Options::incremental_rehash>>;
+  //OPTIMIZATION: using a custom fake container (that mimics detail::flat_map_t)
+  // to store a single value for string_key0, we save a group of slots.
+  map_t<detail::string_key0> m0;
+  map_t<detail::string_key8> m1;
+  map_t<detail::string_key16> m2;
+  map_t<detail::string_key24> m3;
+  using long_key_t = std::conditional_t<Options::arena_keys, detail::string_key_ref,
+                                        detail::string_key_str>;
+  std::conditional_t<Options::long_key_filter,
+                     detail::filtered_map_t<map_t<long_key_t>, detail::hasher_t, Options::counters>,
+                     map_t<long_key_t>> ms;
+  detail::arena_t m_arena;  // long keys' chars, if Options::arena_keys
+  struct no_counters {};
+  std::conditional_t<Options::counters, string_hash_table_counters, no_counters> m_counters;
+  struct class_mix_t {
+    static constexpr uint64_t min_total = 64;  // insertions to rely on
+    uint64_t counts[5] = {};
+    uint64_t total = 0;
+  };
+  struct no_class_mix {};
+  // Insertions by key type, if Options::adaptive_reserve. It survives clear().
+  std::conditional_t<Options::adaptive_reserve, class_mix_t, no_class_mix> m_class_mix;
 
   template <typename Func>
   inline decltype(auto) ALWAYS_INLINE dispatch(const key_type &key, Func &&func);
-  template <typename... Args>
-  std::pair<mapped_type *, bool> emplace(const key_type &key, Args &&... args);
+  template <typename Func>
+  inline decltype(auto) ALWAYS_INLINE dispatch(std::string_view sv, Func &&func);
+  template <bool Padded = false, typename Func>
+  inline decltype(auto) ALWAYS_INLINE dispatch(detail::key_type type, std::string_view sv,
+                                               size_t hash, Func &&func);
+  // Batch processing of keys(i) for i in [0, count), Padded: the keys are followed by at least 8
+  // readable bytes.
+  template <bool Padded, typename Keys, typename Func>
+  void for_batch(const Keys &keys, size_t count, Func &&func);
+  template <bool Padded, typename Keys>
+  void find_batch(const Keys &keys, size_t count, mapped_type **out);
+  template <bool Padded, typename Keys>
+  void try_emplace_batch(const Keys &keys, size_t count, mapped_type **out, bool *inserted);
+  template <bool Padded, typename Keys, typename V, typename F>
+  void accumulate(const Keys &keys, const V *values, size_t count, F &&combine);
+  static auto column_keys(const size_t *offsets, const char *chars) {
+    return [offsets, chars](size_t i) {
+      return std::string_view(chars + offsets[i], offsets[i + 1] - offsets[i]);
+    };
+  }
+  template <typename Map, typename Key, typename Tuple>
+  std::pair<typename Map::value_type *, bool> emplace_slot(Map &map, const Key &key, size_t hash,
+                                                           Tuple &&targs);
+  template <typename Map, typename Key, typename Tuple>
+  std::pair<mapped_type *, bool> emplace(Map &map, const Key &key, size_t hash, Tuple &&targs) {
+    auto [slot, inserted] = emplace_slot(map, key, hash, std::forward<Tuple>(targs));
+    return {&slot->second, inserted};
+  }
+  template <typename Key>
+  inline decltype(auto) ALWAYS_INLINE to_stored_key(const Key &key);
+  void reserve_classes(const size_t (&class_counts)[5]) {
+    m0.reserve(std::min<size_t>(class_counts[detail::key_type0], 1));
+    m1.reserve(class_counts[detail::key_type8]);
+    m2.reserve(class_counts[detail::key_type16]);
+    m3.reserve(class_counts[detail::key_type24]);
+    ms.reserve(class_counts[detail::key_type_str]);
+  }
+  bool reserve_by_mix(size_t elem_count);
+  template <typename Map>
+  detail::key_type map_key_type(const Map &) const {
+    if constexpr (std::is_same_v<Map, decltype(m0)>) return detail::key_type0;
+    else if constexpr (std::is_same_v<Map, decltype(m1)>) return detail::key_type8;
+    else if constexpr (std::is_same_v<Map, decltype(m2)>) return detail::key_type16;
+    else if constexpr (std::is_same_v<Map, decltype(m3)>) return detail::key_type24;
+    else return detail::key_type_str;
+  }
+  template <typename Map>
+  void grow_along(const Map &grown);
+  void ALWAYS_INLINE count_lookup(bool found) {
+    if constexpr (Options::counters) ++(found ? m_counters.hits : m_counters.misses);
+  }
 };
 
-template <typename T>
+template <typename T, typename Options>
 template <typename Func>
-decltype(auto) string_hash_table_t<T>::dispatch(const key_type &key, Func &&func) {
+decltype(auto) string_hash_table_t<T, Options>::dispatch(const key_type &key, Func &&func) {
   switch (key.type()) {
     case detail::key_type0: return func(m0, key.get_string_key<detail::key_type0>());
     case detail::key_type8: return func(m1, key.get_string_key<detail::key_type8>());
     case detail::key_type16: return func(m2, key.get_string_key<detail::key_type16>());
     case detail::key_type24: return func(m3, key.get_string_key<detail::key_type24>());
-    case detail::key_type_str: return func(ms, key.get_string_key<detail::key_type_str>());
+    case detail::key_type_str:
+      if (key.borrowed()) return func(ms, key.get_string_key<detail::key_type_str + 1>());
+      return func(ms, key.get_string_key<detail::key_type_str>());
     default: UNREACHABLE();
   };
 }
 
-template <typename T>
-typename string_hash_table_t<T>::mapped_type *string_hash_table_t<T>::find(const key_type &key) {
-  auto callback = [](auto &map, auto key) -> mapped_type * {
-    auto it = map.find(key);
-    return map.end() != it ? &it->second : nullptr;
+template <typename T, typename Options>
+template <typename Func>
+decltype(auto) string_hash_table_t<T, Options>::dispatch(std::string_view sv, Func &&func) {
+  switch (detail::map_size_to_key_type(std::size(sv))) {
+    case detail::key_type0: return func(m0, detail::string_key0());
+    case detail::key_type8: return func(m1, detail::to_string_key8(sv));
+    case detail::key_type16: return func(m2, detail::to_string_key16(sv));
+    case detail::key_type24: return func(m3, detail::to_string_key24(sv));
+    case detail::key_type_str: return func(ms, detail::to_string_key_view(sv));
+    default: UNREACHABLE();
+  };
+}
+
+template <typename T, typename Options>
+template <bool Padded, typename Func>
+decltype(auto) string_hash_table_t<T, Options>::dispatch(detail::key_type type, std::string_view sv,
+                                                         size_t hash, Func &&func) {
+  // Note: the string is already classified and hashed.
+  switch (type) {
+    case detail::key_type0: return func(m0, detail::string_key0(), hash);
+    case detail::key_type8:
+      return func(m1, Padded ? detail::to_padded_string_key8(sv) : detail::to_string_key8(sv),
+                  hash);
+    case detail::key_type16:
+      return func(m2, Padded ? detail::to_padded_string_key16(sv) : detail::to_string_key16(sv),
+                  hash);
+    case detail::key_type24:
+      return func(m3, Padded ? detail::to_padded_string_key24(sv) : detail::to_string_key24(sv),
+                  hash);
+    case detail::key_type_str: {
+      detail::string_key_view key{detail::to_string_key_head(sv, hash), std::data(sv)};
+      return func(ms, key, hash);
+    }
+    default: UNREACHABLE();
+  };
+}
+
+template <typename T, typename Options>
+template <bool Padded, typename Keys, typename Func>
+void string_hash_table_t<T, Options>::for_batch(const Keys &keys, size_t count, Func &&func) {
+  constexpr size_t block_size = 16;
+  std::string_view block[block_size];
+  detail::key_type types[block_size];
+  size_t hashes[block_size];
+  for (size_t begin = 0; begin < count; begin += block_size) {
+    size_t n = std::min(block_size, count - begin);
+    for (size_t i = 0; i < n; ++i) {
+      block[i] = keys(begin + i);
+      types[i] = detail::map_size_to_key_type(std::size(block[i]));
+    }
+    for (size_t i = 0; i < n; ++i) {
+      hashes[i] = detail::string_key_hash<Padded>(types[i], block[i]);
+    }
+    for (size_t i = 0; i < n; ++i) {
+      switch (types[i]) {
+        case detail::key_type0: m0.prefetch(hashes[i]); break;
+        case detail::key_type8: m1.prefetch(hashes[i]); break;
+        case detail::key_type16: m2.prefetch(hashes[i]); break;
+        case detail::key_type24: m3.prefetch(hashes[i]); break;
+        case detail::key_type_str: ms.prefetch(hashes[i]); break;
+        default: UNREACHABLE();
+      }
+    }
+    for (size_t i = 0; i < n; ++i) {
+      dispatch<Padded>(types[i], block[i], hashes[i], [&func, i = begin + i](auto &map,
+                                                                             const auto &key,
+                                                                             size_t hash) {
+        func(i, map, key, hash);
+      });
+    }
+  }
+}
+
+template <typename T, typename Options>
+void string_hash_table_t<T, Options>::find_batch(const std::string_view *keys, size_t count,
+                                                 mapped_type **out) {
+  find_batch<false>([keys](size_t i) { return keys[i]; }, count, out);
+}
+
+template <typename T, typename Options>
+void string_hash_table_t<T, Options>::try_emplace_batch(const std::string_view *keys,
+                                                        size_t count, mapped_type **out,
+                                                        bool *inserted) {
+  try_emplace_batch<false>([keys](size_t i) { return keys[i]; }, count, out, inserted);
+}
+
+template <typename T, typename Options>
+template <typename V, typename F>
+void string_hash_table_t<T, Options>::accumulate(const std::string_view *keys, const V *values,
+                                                 size_t count, F &&combine) {
+  accumulate<false>([keys](size_t i) { return keys[i]; }, values, count,
+                    std::forward<F>(combine));
+}
+
+template <typename T, typename Options>
+void string_hash_table_t<T, Options>::find_column(const size_t *offsets, const char *chars,
+                                                  size_t count, mapped_type **out) {
+  find_batch<true>(column_keys(offsets, chars), count, out);
+}
+
+template <typename T, typename Options>
+void string_hash_table_t<T, Options>::try_emplace_column(const size_t *offsets, const char *chars,
+                                                         size_t count, mapped_type **out,
+                                                         bool *inserted) {
+  try_emplace_batch<true>(column_keys(offsets, chars), count, out, inserted);
+}
+
+template <typename T, typename Options>
+template <typename V, typename F>
+void string_hash_table_t<T, Options>::accumulate_column(const size_t *offsets, const char *chars,
+                                                        size_t count, const V *values,
+                                                        F &&combine) {
+  accumulate<true>(column_keys(offsets, chars), values, count, std::forward<F>(combine));
+}
+
+template <typename T, typename Options>
+template <bool Padded, typename Keys>
+void string_hash_table_t<T, Options>::find_batch(const Keys &keys, size_t count,
+                                                 mapped_type **out) {
+  for_batch<Padded>(keys, count, [this, out](size_t i, auto &map, const auto &key, size_t hash) {
+    size_t index = map.find_index(hash, [&key](const auto &k) { return k == key; });
+    out[i] = index != map.npos ? &map.slot(index).second : nullptr;
+    count_lookup(out[i]);
+  });
+}
+
+template <typename T, typename Options>
+template <bool Padded, typename Keys>
+void string_hash_table_t<T, Options>::try_emplace_batch(const Keys &keys, size_t count,
+                                                        mapped_type **out, bool *inserted) {
+  size_t counts[5] = {};
+  for (size_t i = 0; i < count; ++i) {
+    ++counts[detail::map_size_to_key_type(std::size(keys(i)))];
+  }
+  counts[detail::key_type0] += m0.size();
+  counts[detail::key_type8] += m1.size();
+  counts[detail::key_type16] += m2.size();
+  counts[detail::key_type24] += m3.size();
+  counts[detail::key_type_str] += ms.size();
+  reserve_classes(counts);
+
+  for_batch<Padded>(keys, count, [this, out, inserted](size_t i, auto &map, const auto &key,
+                                                       size_t hash) {
+    auto [value, emplaced] = emplace(map, key, hash, std::tuple<>());
+    out[i] = value;
+    if (inserted) inserted[i] = emplaced;
+  });
+}
+
+template <typename T, typename Options>
+template <bool Padded, typename Keys, typename V, typename F>
+void string_hash_table_t<T, Options>::accumulate(const Keys &keys, const V *values, size_t count,
+                                                 F &&combine) {
+  for_batch<Padded>(keys, count, [this, values, &combine](size_t i, auto &map, const auto &key,
+                                                          size_t hash) {
+    auto [value, inserted] = emplace(map, key, hash, std::forward_as_tuple(values[i]));
+    if (!inserted) combine(*value, values[i]);
+  });
+}
+
+template <typename T, typename Options>
+typename string_hash_table_t<T, Options>::mapped_type *string_hash_table_t<T, Options>::find(const key_type &key) {
+  auto callback = [this](auto &map, const auto &key) -> mapped_type * {
+    auto slot = map.find(key);
+    count_lookup(slot);
+    return slot ? &slot->second : nullptr;
   };
   return dispatch(key, callback);
 }
 
-template <typename T>
+template <typename T, typename Options>
+template <typename K>
+detail::if_string_like_t<K, typename string_hash_table_t<T, Options>::mapped_type *>
+string_hash_table_t<T, Options>::find(const K &key) {
+  auto callback = [this](auto &map, const auto &key) -> mapped_type * {
+    auto slot = map.find(key);
+    count_lookup(slot);
+    return slot ? &slot->second : nullptr;
+  };
+  return dispatch(std::string_view(key), callback);
+}
+
+template <typename T, typename Options>
+template <typename Map, typename Key, typename Tuple>
+std::pair<typename Map::value_type *, bool> string_hash_table_t<T, Options>::emplace_slot(
+  Map &map, const Key &key, size_t hash, Tuple &&targs) {
+  [[maybe_unused]] size_t capacity = map.capacity();
+  auto [index, found] = map.find_or_prepare_insert(hash, [&key](const auto &k) {
+    return k == key;
+  });
+  if constexpr (Options::counters) {
+    ++(found ? m_counters.hits : m_counters.inserts);
+    m_counters.rehashes += map.capacity() != capacity;
+  }
+  if (found) return {&map.slot(index), false};
+  auto &slot = map.emplace_at(index, hash, std::piecewise_construct,
+                              std::forward_as_tuple(to_stored_key(key)),
+                              std::forward<Tuple>(targs));
+  if constexpr (Options::adaptive_reserve) {
+    ++m_class_mix.counts[map_key_type(map)];
+    ++m_class_mix.total;
+    if (UNLIKELY(map.capacity() != capacity)) grow_along(map);
+  }
+  return {&slot, true};
+}
+
+template <typename T, typename Options>
+bool string_hash_table_t<T, Options>::reserve_by_mix(size_t elem_count) {
+  if (m_class_mix.total < m_class_mix.min_total) return false;
+  size_t class_counts[5];
+  for (size_t i = 0; i < 5; ++i) {
+    class_counts[i] = (m_class_mix.counts[i] * elem_count + m_class_mix.total - 1)
+      / m_class_mix.total;
+  }
+  reserve_classes(class_counts);
+  return true;
+}
+
+template <typename T, typename Options>
+template <typename Map>
+void string_hash_table_t<T, Options>::grow_along(const Map &grown) {
+  // The other submaps are sized for the table to double, but not beyond the grown one getting
+  // full. The grown one is left as is: pointers into it are returned to the caller. Growth of
+  // minor classes says little about the rest, it's ignored.
+  uint64_t grown_count = m_class_mix.counts[map_key_type(grown)];
+  if (m_class_mix.total < m_class_mix.min_total || grown_count < m_class_mix.total / 16) return;
+  size_t elem_count = std::min<size_t>(size() * 2,
+                                       grown.max_load() * m_class_mix.total / grown_count);
+  auto grow = [&](auto &map) {
+    if (static_cast<const void *>(&map) == &grown) return;
+    map.reserve(m_class_mix.counts[map_key_type(map)] * elem_count / m_class_mix.total);
+  };
+  grow(m1);
+  grow(m2);
+  grow(m3);
+  grow(ms);
+}
+
+template <typename T, typename Options>
+string_hash_table_stats_t string_hash_table_t<T, Options>::stats() const {
+  string_hash_table_stats_t res;
+  res.classes[detail::key_type0] = m0.stats();
+  res.classes[detail::key_type8] = m1.stats();
+  res.classes[detail::key_type16] = m2.stats();
+  res.classes[detail::key_type24] = m3.stats();
+  res.classes[detail::key_type_str] = ms.stats();
+  if constexpr (Options::long_key_filter) res.long_key_filter = ms.filter_stats();
+  if constexpr (Options::arena_keys) {
+    res.key_bytes = m_arena.allocated_bytes();
+  } else {
+    for (const auto &slot : ms) res.key_bytes += slot.first.size;  // w/o allocation overhead
+  }
+  res.memory_bytes = res.key_bytes + res.long_key_filter.memory_bytes;
+  for (const auto &stats : res.classes) {
+    res.size += stats.size;
+    res.memory_bytes += stats.memory_bytes;
+  }
+  if constexpr (Options::counters) res.counters = m_counters;
+  return res;
+}
+
+template <typename T, typename Options>
+template <typename Key>
+decltype(auto) string_hash_table_t<T, Options>::to_stored_key(const Key &key) {
+  if constexpr (Options::arena_keys && (std::is_same_v<Key, detail::string_key_str>
+                                        || std::is_same_v<Key, detail::string_key_view>)) {
+    return detail::string_key_ref{key, m_arena.copy(detail::to_string_view(key))};
+  } else {
+    return detail::to_stored_key(key);
+  }
+}
+
+template <typename T, typename Options>
 template <typename... Args>
-std::pair<typename string_hash_table_t<T>::mapped_type *, bool> string_hash_table_t<T>::emplace(
+std::pair<typename string_hash_table_t<T, Options>::mapped_type *, bool> string_hash_table_t<T, Options>::try_emplace(
   const key_type &key, Args &&... args) {
-  // Note: There is failed to determine rvalue ref. after forwarding as tuple, i.e. when
-  // input args start from rvalue (obtained from std::move()), the following returns false:
-  // auto m_args = std::forward_as_tuple(args...);
-  // (std::is_rvalue_reference_v<std::tuple_element_t<0, decltype(m_args)>>) -> returns false,
-  // but the following is ok:
-  // (std::is_rvalue_reference_v<std::tuple_element_t<0, std::tuple<Args &&...>>>) -> returns true.
-
   // Note: We cannot use input parameter pack inside a lambda directly, we need to capture it
   // somehow or pass as parameter. In C++20 a lambda can capture parameter pack:
   // [... args = std::forward<Args>(args)]() { use args }
-  // In C++17 we need to use tuple.
+  // In C++17 we need to use tuple. Note, the tuple must be made of forwarded args, otherwise
+  // rvalue refs. become lvalue ones.
+  auto targs = std::forward_as_tuple(std::forward<Args>(args)...);
+  auto callback = [this, &targs](auto &map, const auto &key) {
+    // Hashing is cheap for short keys, long keys come with already calculated hashes.
+    return emplace(map, key, detail::hasher_t()(key), std::move(targs));
+  };
+  return dispatch(key, callback);
+}
 
-  using t0 = std::tuple_element_t<0, std::tuple<Args &&...>>;
-  auto targs = std::forward_as_tuple(args...);
+template <typename T, typename Options>
+template <typename K, typename... Args>
+detail::if_string_like_t<K, std::pair<typename string_hash_table_t<T, Options>::mapped_type *, bool>>
+string_hash_table_t<T, Options>::try_emplace(const K &key, Args &&... args) {
+  auto targs = std::forward_as_tuple(std::forward<Args>(args)...);
+  auto callback = [this, &targs](auto &map, const auto &key) {
+    return emplace(map, key, detail::hasher_t()(key), std::move(targs));
+  };
+  return dispatch(std::string_view(key), callback);
+}
 
-  if constexpr (sizeof...(Args) == 1 && std::is_rvalue_reference_v<t0>
-    && std::is_same_v<mapped_type, std::decay_t<t0>>) {
-    // scalar 'mapped_type &&'
-    auto callback = [&targs](auto &map, auto key) -> std::pair<mapped_type *, bool> {
-      auto [it, inserted] = map.emplace(key, std::forward<mapped_type>(std::get<0>(targs)));
-      return {&it->second, inserted};
-    };
-    return dispatch(key, callback);
-  } else {
-    // tuple of input args ('mapped_type &' is here)
-    auto callback = [&targs](auto &map, auto key) -> std::pair<mapped_type *, bool> {
-      auto [it, inserted] = map.emplace(std::piecewise_construct,
-                                        std::forward_as_tuple(key), targs);
-      return {&it->second, inserted};
-    };
-    return dispatch(key, callback);
-  }
+template <typename T, typename Options>
+typename string_hash_table_t<T, Options>::mapped_type *string_hash_table_t<T, Options>::find_hashed(
+  std::string_view key, size_t hash) {
+  auto callback = [this](auto &map, const auto &key, size_t hash) -> mapped_type * {
+    size_t index = map.find_index(hash, [&key](const auto &k) { return k == key; });
+    count_lookup(index != map.npos);
+    return index != map.npos ? &map.slot(index).second : nullptr;
+  };
+  return dispatch(detail::map_size_to_key_type(std::size(key)), key, hash, callback);
 }
 
-template <typename T>
+template <typename T, typename Options>
 template <typename... Args>
-std::pair<typename string_hash_table_t<T>::mapped_type *, bool> string_hash_table_t<T>::try_emplace(
-  const key_type &key, Args &&... args) {
-  // Note: Alternatively, just use std::unordered_map::try_emplace().
-  mapped_type *value = find(key);
-  if (value) return {value, false};
-  return emplace(key, std::forward<Args>(args)...);
+std::pair<typename string_hash_table_t<T, Options>::mapped_type *, bool>
+string_hash_table_t<T, Options>::try_emplace_hashed(std::string_view key, size_t hash,
+                                                    Args &&... args) {
+  auto targs = std::forward_as_tuple(std::forward<Args>(args)...);
+  auto callback = [this, &targs](auto &map, const auto &key, size_t hash) {
+    return emplace(map, key, hash, std::move(targs));
+  };
+  return dispatch(detail::map_size_to_key_type(std::size(key)), key, hash, callback);
 }
 
-template <typename T>
-bool string_hash_table_t<T>::erase(const key_type &key) {
-  auto callback = [](auto &map, auto key) -> bool {
-    return (map.erase(key));
+template <typename T, typename Options>
+bool string_hash_table_t<T, Options>::erase_hashed(std::string_view key, size_t hash) {
+  auto callback = [this](auto &map, const auto &key, size_t hash) -> bool {
+    size_t index = map.find_index(hash, [&key](const auto &k) { return k == key; });
+    count_lookup(index != map.npos);
+    if (index == map.npos) return false;
+    map.erase_at(index);
+    return true;
+  };
+  return dispatch(detail::map_size_to_key_type(std::size(key)), key, hash, callback);
+}
+
+template <typename T, typename Options>
+template <typename F>
+void string_hash_table_t<T, Options>::for_each_hashed(F &&f) const {
+  auto each = [&f](const auto &map) {
+    for (const auto &[key, value] : map) {
+      f(detail::to_string_view(key), detail::hasher_t()(key), value);
+    }
+  };
+  each(m0);
+  each(m1);
+  each(m2);
+  each(m3);
+  each(ms);
+}
+
+template <typename T, typename Options>
+template <typename F>
+void string_hash_table_t<T, Options>::for_each_hashed(size_t part, size_t part_count,
+                                                      F &&f) const {
+  auto each = [part, part_count, &f](const auto &map) {
+    const size_t slot_count = map.slot_count();
+    for (size_t i = slot_count * part / part_count, last = slot_count * (part + 1) / part_count;
+         i < last; ++i) {
+      if (!map.full(i)) continue;
+      const auto &[key, value] = map.slot(i);
+      f(detail::to_string_view(key), detail::hasher_t()(key), value);
+    }
+  };
+  each(m0);
+  each(m1);
+  each(m2);
+  each(m3);
+  each(ms);
+}
+
+template <typename T, typename Options>
+size_t string_hash_table_t<T, Options>::key_chars_size() const {
+  size_t res = 0;
+  auto add = [&res](const auto &map) {
+    for (const auto &slot : map) res += std::size(detail::to_string_view(slot.first));
+  };
+  add(m1);
+  add(m2);
+  add(m3);
+  add(ms);
+  return res;
+}
+
+template <typename T, typename Options>
+void string_hash_table_t<T, Options>::export_columns(size_t *offsets, char *chars,
+                                                     mapped_type *values) const {
+  size_t offset = 0;
+  *offsets++ = 0;
+  for_each_hashed([&](std::string_view key, size_t, const mapped_type &value) {
+    memcpy(chars + offset, std::data(key), std::size(key));
+    offset += std::size(key);
+    *offsets++ = offset;
+    if (values) *values++ = value;
+  });
+}
+
+template <typename T, typename Options>
+template <typename Other, typename F>
+void string_hash_table_t<T, Options>::merge(const Other &other, F &&combiner,
+                                            unsigned thread_count) {
+  // Note: hashes do not depend on options, so they are reused. Keys of a submap of other go to
+  // the submap of the same class, so the classes are independent.
+  auto merge_map = [this, &combiner](const auto &map) {
+    for (const auto &[key, value] : map) {
+      auto [mine, inserted] = try_emplace_hashed(detail::to_string_view(key),
+                                                 detail::hasher_t()(key), value);
+      if (!inserted) combiner(*mine, value);
+    }
+  };
+  if (Options::counters || Options::adaptive_reserve || thread_count <= 1) {
+    merge_map(other.m0);
+    merge_map(other.m1);
+    merge_map(other.m2);
+    merge_map(other.m3);
+    merge_map(other.ms);
+    return;
+  }
+  // The largest classes get threads of their own, the calling thread takes the rest
+  std::pair<size_t, int> classes[] = {{other.m1.size(), 1}, {other.m2.size(), 2},
+                                      {other.m3.size(), 3}, {other.ms.size(), 4}};
+  std::sort(std::begin(classes), std::end(classes), std::greater<>());
+  auto merge_class = [&](int type) {
+    switch (type) {
+      case 1: return merge_map(other.m1);
+      case 2: return merge_map(other.m2);
+      case 3: return merge_map(other.m3);
+      default: return merge_map(other.ms);
+    }
+  };
+  std::vector<std::thread> threads;
+  size_t c = 0;
+  for (; c < std::size(classes) && c + 1 < thread_count && classes[c].first; ++c) {
+    threads.emplace_back(merge_class, classes[c].second);
+  }
+  for (; c < std::size(classes); ++c) merge_class(classes[c].second);
+  merge_map(other.m0);
+  for (std::thread &thread : threads) thread.join();
+}
+
+template <typename T, typename Options>
+template <typename M>
+std::pair<typename string_hash_table_t<T, Options>::mapped_type *, bool>
+string_hash_table_t<T, Options>::insert_or_assign(const key_type &key, M &&obj) {
+  // Note: obj is not consumed by try_emplace() unless inserted.
+  auto res = try_emplace(key, std::forward<M>(obj));
+  if (!res.second) *res.first = std::forward<M>(obj);
+  return res;
+}
+
+template <typename T, typename Options>
+template <typename K, typename M>
+detail::if_string_like_t<K, std::pair<typename string_hash_table_t<T, Options>::mapped_type *, bool>>
+string_hash_table_t<T, Options>::insert_or_assign(const K &key, M &&obj) {
+  auto res = try_emplace(key, std::forward<M>(obj));
+  if (!res.second) *res.first = std::forward<M>(obj);
+  return res;
+}
+
+template <typename T, typename Options>
+template <typename V, typename F>
+std::pair<typename string_hash_table_t<T, Options>::mapped_type *, bool>
+string_hash_table_t<T, Options>::upsert(const key_type &key, V &&value, F &&combine) {
+  // Note: value is not consumed by try_emplace() unless inserted.
+  auto res = try_emplace(key, std::forward<V>(value));
+  if (!res.second) combine(*res.first, std::forward<V>(value));
+  return res;
+}
+
+template <typename T, typename Options>
+template <typename K, typename V, typename F>
+detail::if_string_like_t<K, std::pair<typename string_hash_table_t<T, Options>::mapped_type *, bool>>
+string_hash_table_t<T, Options>::upsert(const K &key, V &&value, F &&combine) {
+  auto res = try_emplace(key, std::forward<V>(value));
+  if (!res.second) combine(*res.first, std::forward<V>(value));
+  return res;
+}
+
+template <typename T, typename Options>
+bool string_hash_table_t<T, Options>::erase(const key_type &key) {
+  auto callback = [this](auto &map, const auto &key) -> bool {
+    bool erased = map.erase(key);
+    count_lookup(erased);
+    return erased;
   };
   return dispatch(key, callback);
 }
 
+template <typename T, typename Options>
+template <typename K>
+detail::if_string_like_t<K, bool> string_hash_table_t<T, Options>::erase(const K &key) {
+  auto callback = [this](auto &map, const auto &key) -> bool {
+    bool erased = map.erase(key);
+    count_lookup(erased);
+    return erased;
+  };
+  return dispatch(std::string_view(key), callback);
+}
+
 
 /* ==TRASH==
 */